@@ -8,10 +8,13 @@
 #include <cstdio>
 #include <cstddef>
 #include <cstdlib>
+#include <cstring> // for memcpy
 #include <cassert>
 #include <stdint.h>
-#include <unistd.h> // for sbrk
+#include <unistd.h> // for sysconf
+#include <sys/mman.h> // for mmap
 #include <utility> // for std::declval
+#include <ctime> // for clock_gettime
 
 /**
  * Mode for searching a free block.
@@ -19,7 +22,19 @@
 enum class SearchMode {
   FirstFit,
   NextFit,
-  BestFit
+  BestFit,
+  SegregatedFit,
+  BestFitTree,
+  TLSF,
+  Buddy
+};
+
+/**
+ * When adjacent free blocks are merged.
+ */
+enum class CoalesceMode {
+  Immediate, // on every `free`
+  Deferred   // on a search miss, before asking the OS for more memory
 };
 
 /**
@@ -41,14 +56,11 @@ struct Block
     // 1. Object header
 
     /**
-     * Block size.
+     * Block size. Sizes are aligned by the machine word, so the
+     * low 3 bits are always zero and keep the block flags instead.
+     * Use the `getSize`/`isUsed`/... accessors below.
      */
-    size_t size; // 8bytes
-
-    /**
-     * Whether this block is currently used.
-     */
-    bool used; // 1byte + 7bytes for padding
+    size_t sizeAndFlags; // 8bytes
 
     /**
      * Next block in the list.
@@ -64,6 +76,50 @@ struct Block
     word_t data[1]; // 8bytes
 };
 
+/**
+ * Block flags, stored in the low bits of `Block::sizeAndFlags`.
+ */
+static constexpr size_t kUsed = 1;     // the block is allocated
+static constexpr size_t kMarked = 2;   // reachable, set by a collector
+static constexpr size_t kPrevUsed = 4; // the physical predecessor is not free
+static constexpr size_t kFlagsMask = kUsed | kMarked | kPrevUsed;
+
+inline size_t getSize(Block* block) {
+  return block->sizeAndFlags & ~kFlagsMask;
+}
+
+inline void setSize(Block* block, size_t size) {
+  block->sizeAndFlags = size | (block->sizeAndFlags & kFlagsMask);
+}
+
+inline void setFlag(Block* block, size_t flag, bool value) {
+  block->sizeAndFlags = value ? block->sizeAndFlags | flag : block->sizeAndFlags & ~flag;
+}
+
+inline bool isUsed(Block* block) {
+  return block->sizeAndFlags & kUsed;
+}
+
+inline void setUsed(Block* block, bool used) {
+  setFlag(block, kUsed, used);
+}
+
+inline bool isMarked(Block* block) {
+  return block->sizeAndFlags & kMarked;
+}
+
+inline void setMarked(Block* block, bool marked) {
+  setFlag(block, kMarked, marked);
+}
+
+inline bool isPrevUsed(Block* block) {
+  return block->sizeAndFlags & kPrevUsed;
+}
+
+inline void setPrevUsed(Block* block, bool prevUsed) {
+  setFlag(block, kPrevUsed, prevUsed);
+}
+
 /**
  * Heap start. Initialized on first allocation.
  */
@@ -74,6 +130,117 @@ static Block* heapStart = nullptr;
  */
 static Block* top = heapStart;
 
+/**
+ * Region of memory mapped from the OS. Blocks are bump-allocated
+ * in it, right after the chunk header.
+ */
+struct Chunk
+{
+    /**
+     * Previously mapped chunk.
+     */
+    Chunk* next;
+
+    /**
+     * Mapped size, including this header.
+     */
+    size_t size;
+
+    /**
+     * First unused byte, where the next block goes.
+     */
+    char* bump;
+
+    /**
+     * End of the mapping.
+     */
+    char* end;
+};
+
+/**
+ * Mapped chunks, the current (bump) one first.
+ */
+static Chunk* chunks = nullptr;
+
+/**
+ * Chunks grow geometrically from 1 MiB up to 64 MiB.
+ */
+static constexpr size_t kMinChunkSize = size_t(1) << 20;
+static constexpr size_t kMaxChunkSize = size_t(64) << 20;
+
+/**
+ * Size of the next chunk to map. Updated in `mapChunk`.
+ */
+static size_t nextChunkSize = kMinChunkSize;
+
+/**
+ * Header of a large object, mapped on its own. It is followed by the
+ * usual Block header of the object, tagged with `kLargeObjectTag`.
+ */
+struct LargeObject
+{
+    /**
+     * Neighbours in the list of large objects.
+     */
+    LargeObject* prev;
+    LargeObject* next;
+
+    /**
+     * Mapped size, including this header.
+     */
+    size_t size;
+};
+
+/**
+ * Live large objects. They never enter the heap chain or the free lists.
+ */
+static LargeObject* largeObjects = nullptr;
+
+/**
+ * Requests of at least this many bytes are large objects.
+ */
+static constexpr size_t kDefaultLargeObjectThreshold = size_t(128) << 10;
+static size_t largeObjectThreshold = kDefaultLargeObjectThreshold;
+
+/**
+ * For trimming
+ */
+
+/**
+ * Bytes freed since the last trim. Updated in `free`.
+ */
+static size_t dirtyBytes = 0;
+
+/**
+ * When `dirtyBytes` became non-zero, in milliseconds.
+ */
+static long dirtySince = 0;
+
+/**
+ * Trim once at least this many bytes are dirty...
+ */
+static size_t trimThreshold = size_t(1) << 20;
+
+/**
+ * ...and they stayed dirty for this long (like jemalloc's dirty decay).
+ */
+static long dirtyDecayMs = 10000;
+
+/**
+ * Sets the trim threshold and the decay time (0 trims right away).
+ */
+void setTrimPolicy(size_t threshold, long decayMs) {
+  trimThreshold = threshold;
+  dirtyDecayMs = decayMs;
+}
+
+/**
+ * Sets the size from which requests are mapped separately.
+ */
+void setLargeObjectThreshold(size_t size) {
+  largeObjectThreshold = size;
+}
+
 /**
  * For next fit
 */
@@ -83,35 +250,203 @@ static Block* top = heapStart;
  */
 static Block* searchStart = heapStart;
 
+/**
+ * Free block the next search resumes from.
+ * Updated in `nextFit` and `removeFree`.
+ */
+static Block* searchRover = nullptr;
+
+/**
+ * Explicit free list, linked through the payload of free blocks.
+ * Updated in `free` and `listAllocate`.
+ */
+static Block* freeList = nullptr;
+
 /**
  * Current search mode.
  */
 static SearchMode searchMode = SearchMode::FirstFit;
 
 /**
- * Reset the heap to the original position.
+ * Current coalesce mode.
  */
-void resetHeap()
+static CoalesceMode coalesceMode = CoalesceMode::Immediate;
+
+/**
+ * For segregated fit
+ */
+
+/**
+ * Number of exact size classes: 8, 16, 24, ..., 128 bytes.
+ * Every block in an exact class has the same size.
+ */
+static constexpr size_t kExactClasses = 16;
+
+/**
+ * Largest size served by an exact class.
+ */
+static constexpr size_t kMaxExactSize = kExactClasses * sizeof(word_t);
+
+/**
+ * Number of power-of-two classes above the exact ones:
+ * (128, 256], (256, 512], ... The last one also takes everything bigger.
+ */
+static constexpr size_t kPowerOfTwoClasses = 24;
+
+/**
+ * Total number of size classes.
+ */
+static constexpr size_t kSizeClasses = kExactClasses + kPowerOfTwoClasses;
+
+static_assert(kSizeClasses <= 64, "non-empty classes are tracked in a 64-bit mask");
+
+/**
+ * Free lists per size class. Updated in `free` and `listAllocate`.
+ */
+static Block* segregatedLists[kSizeClasses];
+
+/**
+ * Bit `i` is set when `segregatedLists[i]` is not empty, so the next
+ * non-empty class is found with a single count-trailing-zeros.
+ */
+static uint64_t nonEmptyClasses = 0;
+
+/**
+ * For best-fit tree
+ */
+
+/**
+ * Root of the size-ordered tree of free blocks.
+ * Updated in `free` and `listAllocate`.
+ */
+static Block* freeTree = nullptr;
+
+/**
+ * For TLSF (two-level segregated fit)
+ */
+
+/**
+ * Each first-level range [2^n, 2^(n+1)) is split linearly
+ * into 2^kTlsfSecondLevelBits second-level lists.
+ */
+static constexpr size_t kTlsfSecondLevelBits = 4;
+static constexpr size_t kTlsfSecondLevels = size_t(1) << kTlsfSecondLevelBits;
+
+/**
+ * Sizes below it all go to the first first-level, in steps of a word.
+ */
+static constexpr size_t kTlsfSmallSize = kTlsfSecondLevels * sizeof(word_t);
+
+/**
+ * First-level 0 holds the small sizes, the others [128, 256), [256, 512), ...
+ */
+static constexpr size_t kTlsfFirstLevels = 32;
+
+/**
+ * Free lists per (first, second) level. Updated in `free` and `listAllocate`.
+ */
+static Block* tlsfLists[kTlsfFirstLevels][kTlsfSecondLevels];
+
+/**
+ * Bit `fl` is set when any list of the first-level `fl` is not empty,
+ * bit `sl` of `tlsfSecondLevelMasks[fl]` when the list `(fl, sl)` is not empty.
+ */
+static uint32_t tlsfFirstLevelMask = 0;
+static uint32_t tlsfSecondLevelMasks[kTlsfFirstLevels];
+
+/**
+ * For buddy allocation
+ */
+
+/**
+ * Blocks are 2^order bytes including the header: the smallest one
+ * fits the header and the two free-list links, the biggest one
+ * is the whole arena.
+ */
+static constexpr size_t kBuddyMinOrder = 5;
+static constexpr size_t kBuddyMaxOrder = 26;
+
+/**
+ * The buddy arena, mapped on the first allocation.
+ */
+static char* buddyArena = nullptr;
+
+/**
+ * Free lists per order, and the mask of the non-empty ones.
+ */
+static Block* buddyLists[kBuddyMaxOrder + 1];
+static uint64_t buddyNonEmptyOrders = 0;
+
+/**
+ * For slabs
+ */
+
+/**
+ * A page of same-size small objects. Objects have no header: the slab
+ * is found by rounding an object address down to the slab size, and
+ * free objects are linked through their first word.
+ */
+struct Slab
 {
-  // Already reset.
-  if (heapStart == nullptr) {
-    return;
-  }
- 
-  // Roll back to the beginning.
-  brk(heapStart);
- 
-  heapStart = nullptr;
-  top = nullptr;
-  searchStart = nullptr;
-}
+    /**
+     * Neighbours in the list of partial slabs of the size class
+     * (or in the list of empty slabs).
+     */
+    Slab* prev;
+    Slab* next;
+
+    /**
+     * Free objects in this slab.
+     */
+    word_t* freeObjects;
+
+    /**
+     * Object size of the size class.
+     */
+    uint32_t objectSize;
+
+    /**
+     * Number of allocated objects.
+     */
+    uint32_t used;
+};
 
 /**
- * Initializes the heap, and the search mode.
+ * Slab size, slabs are aligned by it.
  */
-void init(SearchMode mode) {
-  searchMode = mode;
-  resetHeap();
+static constexpr size_t kSlabSize = 4096;
+
+/**
+ * Object sizes served by slabs.
+ */
+static constexpr size_t kSlabClassSizes[] = {8, 16, 32, 48, 64};
+static constexpr size_t kSlabClasses = sizeof(kSlabClassSizes) / sizeof(kSlabClassSizes[0]);
+static constexpr size_t kMaxSlabObjectSize = kSlabClassSizes[kSlabClasses - 1];
+
+/**
+ * Slabs are bump-allocated in a reserved region,
+ * so `free` recognizes slab objects with a range check.
+ */
+static constexpr size_t kSlabRegionSize = size_t(64) << 20;
+static char* slabRegion = nullptr;
+static char* slabBump = nullptr;
+
+/**
+ * Slabs with free objects per size class, and released empty slabs.
+ */
+static Slab* partialSlabs[kSlabClasses];
+static Slab* emptySlabs = nullptr;
+
+/**
+ * Whether small requests go to the slabs.
+ */
+static bool useSlabs = false;
+
+/**
+ * Turns the slab layer on or off.
+ */
+void enableSlabs(bool enabled) {
+  useSlabs = enabled;
 }
 
 /**
@@ -122,9 +457,30 @@ inline size_t align(size_t n)
     return (n + sizeof(word_t) - 1) & ~(sizeof(word_t) - 1);
 }
 
+/**
+ * Minimum payload size: a free block stores two free-list links
+ * and its footer in it.
+ */
+static constexpr size_t kMinPayloadSize = 3 * sizeof(word_t);
+
+/**
+ * Smallest payload left over by `split`: remainders below it stay
+ * inside the allocated block instead of becoming unusable slivers.
+ */
+static size_t minSplitRemainder = kMinPayloadSize;
+
+/**
+ * Sets the split threshold, at least `kMinPayloadSize`.
+ */
+void setMinSplitRemainder(size_t size) {
+  size = align(size);
+  minSplitRemainder = size < kMinPayloadSize ? kMinPayloadSize : size;
+}
+
 /**
  * Returns total allocation size, reserving in addition the space for
- * the Block structure (object header + first data word).
+ * the Block structure (object header + first data word). Used blocks
+ * have no footer: only free ones keep it, inside the payload.
  *
  * Since the `word_t data[1]` already allocates one word inside the Block
  * structure, we decrease it from the size request: if a user allocates
@@ -133,26 +489,101 @@ inline size_t align(size_t n)
 inline size_t allocSize(size_t size) {
   return size + sizeof(Block) - sizeof(std::declval<Block>().data);
 }
- 
+
 /**
- * Requests (maps) memory from OS.
+ * Reset the heap to the original position.
  */
-Block* requestFromOS(size_t size) {
-  // Current heap break.
-  Block* block = (Block*) sbrk(0);                // (1)
+void resetHeap()
+{
+  // Every part is reset on its own: large objects, the buddy arena
+  // and the slabs are used without a `heapStart` chain.
 
-  // OOM. (Out Of Memory)
-  size_t deltaIncrement = allocSize(size);
-  // printf("%p == sbrk(0)\n", block);
-  if (sbrk(deltaIncrement) == (void *)-1) {    // (2)
-    return nullptr;
+  // Unmap all the chunks.
+  while (chunks != nullptr) {
+    Chunk* next = chunks->next;
+    munmap(chunks, chunks->size);
+    chunks = next;
+  }
+  nextChunkSize = kMinChunkSize;
+
+  while (largeObjects != nullptr) {
+    LargeObject* next = largeObjects->next;
+    munmap(largeObjects, largeObjects->size);
+    largeObjects = next;
   }
-  // printf("sbrk(%li)\n", deltaIncrement);
-  // printf("%p == sbrk(0)\n", sbrk(0));
  
-  return block;
+  heapStart = nullptr;
+  top = nullptr;
+  dirtyBytes = 0;
+  searchStart = nullptr;
+  searchRover = nullptr;
+  freeList = nullptr;
+
+  for (Block*& list : segregatedLists) {
+    list = nullptr;
+  }
+  nonEmptyClasses = 0;
+  freeTree = nullptr;
+
+  for (auto& lists : tlsfLists) {
+    for (Block*& list : lists) {
+      list = nullptr;
+    }
+  }
+  tlsfFirstLevelMask = 0;
+  for (uint32_t& mask : tlsfSecondLevelMasks) {
+    mask = 0;
+  }
+
+  if (buddyArena != nullptr) {
+    munmap(buddyArena, size_t(1) << kBuddyMaxOrder);
+    buddyArena = nullptr;
+  }
+  for (Block*& list : buddyLists) {
+    list = nullptr;
+  }
+  buddyNonEmptyOrders = 0;
+
+  if (slabRegion != nullptr) {
+    munmap(slabRegion, kSlabRegionSize);
+    slabRegion = nullptr;
+    slabBump = nullptr;
+  }
+  for (Slab*& slab : partialSlabs) {
+    slab = nullptr;
+  }
+  emptySlabs = nullptr;
+}
+
+/**
+ * Initializes the heap, the search and the coalesce modes.
+ */
+void init(SearchMode mode, CoalesceMode coalesce = CoalesceMode::Immediate) {
+  searchMode = mode;
+  coalesceMode = coalesce;
+  resetHeap();
+}
+
+/**
+ * Boundary tag: the last payload word of a free block repeats its size.
+ * It lets `free` find a free physical predecessor in O(1); used blocks
+ * don't have one, the prev-used bit of the successor tells them apart.
+ */
+inline word_t* getFooter(Block* block) {
+  return (word_t*)((char*)block->data + getSize(block)) - 1;
+}
+
+inline void setFooter(Block* block) {
+  *getFooter(block) = block->sizeAndFlags & ~(kMarked | kPrevUsed);
 }
 
+/**
+ * Large objects are never chained, so their `next` field holds this
+ * tag instead (not a valid block address): `free` tells them apart
+ * in O(1) from the header alone.
+ */
+static constexpr uintptr_t kLargeObjectTag = 1;
+
 /**
  * Returns the object header.
  */
@@ -165,26 +596,382 @@ Block* getHeader(word_t* data) {
 }
 
 /**
- * First-fit algorithm.
- *
- * Returns the first free block which fits the size.
+ * Free blocks don't use their payload, so the free-list links
+ * are stored in the first two data words instead of growing the header.
+ * The payload is declared as words: the links are copied in and out
+ * with memcpy (a plain load or store at -O1 and up) rather than through
+ * a cast pointer, which would break strict aliasing.
  */
-Block* firstFit(size_t alignedSize)
+inline Block* nextFree(Block* block) {
+  Block* next;
+  memcpy(&next, &block->data[0], sizeof(next));
+  return next;
+}
+
+inline Block* prevFree(Block* block) {
+  Block* prev;
+  memcpy(&prev, (char*)block->data + sizeof(Block*), sizeof(prev));
+  return prev;
+}
+
+inline void setNextFree(Block* block, Block* next) {
+  memcpy(&block->data[0], &next, sizeof(next));
+}
+
+inline void setPrevFree(Block* block, Block* prev) {
+  memcpy((char*)block->data + sizeof(Block*), &prev, sizeof(prev));
+}
+
+/**
+ * Returns the size class of an aligned size.
+ */
+inline size_t sizeClass(size_t alignedSize) {
+  if (alignedSize <= kMaxExactSize) {
+    return alignedSize / sizeof(word_t) - 1;
+  }
+
+  // Number of bits needed for (size - 1), i.e. log2 rounded up:
+  // (128, 256] -> 8, (256, 512] -> 9, ...
+  size_t bits = 64 - __builtin_clzll(alignedSize - 1);
+  size_t index = kExactClasses + bits - 8;
+
+  return index < kSizeClasses ? index : kSizeClasses - 1;
+}
+
+/**
+ * TLSF mapping of a size to its (first, second) level list.
+ */
+inline void tlsfMapping(size_t size, size_t& fl, size_t& sl) {
+  if (size < kTlsfSmallSize) {
+    fl = 0;
+    sl = size / sizeof(word_t);
+    return;
+  }
+
+  size_t log2 = 63 - __builtin_clzll(size);
+  fl = log2 - (kTlsfSecondLevelBits + 3) + 1;
+  sl = (size >> (log2 - kTlsfSecondLevelBits)) ^ kTlsfSecondLevels;
+
+  // Everything bigger shares the last list.
+  if (fl >= kTlsfFirstLevels) {
+    fl = kTlsfFirstLevels - 1;
+    sl = kTlsfSecondLevels - 1;
+  }
+}
+
+/**
+ * Returns the head of the free list a block of this size belongs to.
+ */
+inline Block*& freeListFor(size_t size) {
+  if (searchMode == SearchMode::SegregatedFit) {
+    return segregatedLists[sizeClass(size)];
+  }
+
+  if (searchMode == SearchMode::TLSF) {
+    size_t fl, sl;
+    tlsfMapping(size, fl, sl);
+    return tlsfLists[fl][sl];
+  }
+
+  return freeList;
+}
+
+/**
+ * Best-fit tree: a left-leaning red-black tree of free blocks, keyed by
+ * (size, address). The nodes are the free blocks themselves: the two
+ * payload words hold the left and right children, and the low bit of
+ * the left one is the color of the link to the node (red when set).
+ * The left word is read as the unsigned twin of `word_t` (which may
+ * alias it), the right pointer is copied like the free-list links.
+ */
+inline uintptr_t& leftWord(Block* node) {
+  return ((uintptr_t*)node->data)[0];
+}
+
+inline Block* treeLeft(Block* node) {
+  return (Block*)(leftWord(node) & ~uintptr_t(1));
+}
+
+inline Block* treeRight(Block* node) {
+  Block* right;
+  memcpy(&right, (char*)node->data + sizeof(Block*), sizeof(right));
+  return right;
+}
+
+inline void setTreeRight(Block* node, Block* right) {
+  memcpy((char*)node->data + sizeof(Block*), &right, sizeof(right));
+}
+
+inline bool isRed(Block* node) {
+  return node != nullptr && (leftWord(node) & 1);
+}
+
+inline void setRed(Block* node, bool red) {
+  leftWord(node) = (leftWord(node) & ~uintptr_t(1)) | red;
+}
+
+inline void setTreeLeft(Block* node, Block* left) {
+  leftWord(node) = (uintptr_t)left | (leftWord(node) & 1);
+}
+
+/**
+ * Strict order of the tree keys: by size, then by address.
+ */
+inline bool treeLess(Block* a, Block* b) {
+  return getSize(a) < getSize(b) || (getSize(a) == getSize(b) && a < b);
+}
+
+Block* rotateLeft(Block* node) {
+  Block* x = treeRight(node);
+  setTreeRight(node, treeLeft(x));
+  setTreeLeft(x, node);
+  setRed(x, isRed(node));
+  setRed(node, true);
+  return x;
+}
+
+Block* rotateRight(Block* node) {
+  Block* x = treeLeft(node);
+  setTreeLeft(node, treeRight(x));
+  setTreeRight(x, node);
+  setRed(x, isRed(node));
+  setRed(node, true);
+  return x;
+}
+
+void flipColors(Block* node) {
+  setRed(node, !isRed(node));
+  setRed(treeLeft(node), !isRed(treeLeft(node)));
+  setRed(treeRight(node), !isRed(treeRight(node)));
+}
+
+/**
+ * Restores the left-leaning invariants on the way up.
+ */
+Block* balance(Block* node) {
+  if (isRed(treeRight(node)) && !isRed(treeLeft(node))) {
+    node = rotateLeft(node);
+  }
+  if (isRed(treeLeft(node)) && isRed(treeLeft(treeLeft(node)))) {
+    node = rotateRight(node);
+  }
+  if (isRed(treeLeft(node)) && isRed(treeRight(node))) {
+    flipColors(node);
+  }
+  return node;
+}
+
+Block* treeInsert(Block* node, Block* block) {
+  if (node == nullptr) {
+    leftWord(block) = 1; // no children, red
+    setTreeRight(block, nullptr);
+    return block;
+  }
+
+  if (treeLess(block, node)) {
+    setTreeLeft(node, treeInsert(treeLeft(node), block));
+  } else {
+    setTreeRight(node, treeInsert(treeRight(node), block));
+  }
+
+  return balance(node);
+}
+
+Block* moveRedLeft(Block* node) {
+  flipColors(node);
+  if (isRed(treeLeft(treeRight(node)))) {
+    setTreeRight(node, rotateRight(treeRight(node)));
+    node = rotateLeft(node);
+    flipColors(node);
+  }
+  return node;
+}
+
+Block* moveRedRight(Block* node) {
+  flipColors(node);
+  if (isRed(treeLeft(treeLeft(node)))) {
+    node = rotateRight(node);
+    flipColors(node);
+  }
+  return node;
+}
+
+Block* treeRemoveMin(Block* node) {
+  if (treeLeft(node) == nullptr) {
+    return nullptr;
+  }
+
+  if (!isRed(treeLeft(node)) && !isRed(treeLeft(treeLeft(node)))) {
+    node = moveRedLeft(node);
+  }
+
+  setTreeLeft(node, treeRemoveMin(treeLeft(node)));
+  return balance(node);
+}
+
+Block* treeRemove(Block* node, Block* block) {
+  if (treeLess(block, node)) {
+    if (!isRed(treeLeft(node)) && !isRed(treeLeft(treeLeft(node)))) {
+      node = moveRedLeft(node);
+    }
+    setTreeLeft(node, treeRemove(treeLeft(node), block));
+    return balance(node);
+  }
+
+  if (isRed(treeLeft(node))) {
+    node = rotateRight(node);
+  }
+
+  if (node == block && treeRight(node) == nullptr) {
+    return nullptr;
+  }
+
+  if (!isRed(treeRight(node)) && !isRed(treeLeft(treeRight(node)))) {
+    node = moveRedRight(node);
+  }
+
+  if (node == block) {
+    // Nodes are the blocks, so instead of copying the successor's key
+    // the successor takes the place of the removed node.
+    Block* successor = treeRight(node);
+    while (treeLeft(successor) != nullptr) {
+      successor = treeLeft(successor);
+    }
+
+    setTreeRight(successor, treeRemoveMin(treeRight(node)));
+    leftWord(successor) = leftWord(node);
+    node = successor;
+  } else {
+    setTreeRight(node, treeRemove(treeRight(node), block));
+  }
+
+  return balance(node);
+}
+
+/**
+ * Validates the tree (order, no red right links, no two reds in a row,
+ * same number of black links on every path). Returns the black height,
+ * or -1 if broken.
+ */
+int checkTree(Block* node) {
+  if (node == nullptr) {
+    return 0;
+  }
+
+  Block* left = treeLeft(node);
+  Block* right = treeRight(node);
+
+  if ((left != nullptr && !treeLess(left, node)) || (right != nullptr && !treeLess(node, right))) {
+    return -1;
+  }
+  if (isRed(right) || (isRed(node) && isRed(left))) {
+    return -1;
+  }
+
+  int leftHeight = checkTree(left);
+  int rightHeight = checkTree(right);
+  if (leftHeight < 0 || leftHeight != rightHeight) {
+    return -1;
+  }
+
+  return leftHeight + (isRed(node) ? 0 : 1);
+}
+
+/**
+ * Pushes a free block to the front of its free list
+ * (or to the tree in best-fit tree mode).
+ */
+void insertFree(Block* block) {
+  if (searchMode == SearchMode::BestFitTree) {
+    freeTree = treeInsert(freeTree, block);
+    setRed(freeTree, false);
+    return;
+  }
+
+  Block*& head = freeListFor(getSize(block));
+
+  setPrevFree(block, nullptr);
+  setNextFree(block, head);
+  if (head != nullptr) {
+    setPrevFree(head, block);
+  }
+  head = block;
+
+  if (searchMode == SearchMode::SegregatedFit) {
+    nonEmptyClasses |= uint64_t(1) << sizeClass(getSize(block));
+  }
+
+  if (searchMode == SearchMode::TLSF) {
+    size_t fl, sl;
+    tlsfMapping(getSize(block), fl, sl);
+    tlsfFirstLevelMask |= uint32_t(1) << fl;
+    tlsfSecondLevelMasks[fl] |= uint32_t(1) << sl;
+  }
+}
+
+/**
+ * Unlinks a block from its free list in O(1)
+ * (or from the tree in O(log n) in best-fit tree mode).
+ */
+void removeFree(Block* block) {
+  if (searchMode == SearchMode::BestFitTree) {
+    if (!isRed(treeLeft(freeTree)) && !isRed(treeRight(freeTree))) {
+      setRed(freeTree, true);
+    }
+    freeTree = treeRemove(freeTree, block);
+    if (freeTree != nullptr) {
+      setRed(freeTree, false);
+    }
+    return;
+  }
+
+  Block*& head = freeListFor(getSize(block));
+
+  if (prevFree(block) != nullptr) {
+    setNextFree(prevFree(block), nextFree(block));
+  } else {
+    head = nextFree(block);
+  }
+
+  if (nextFree(block) != nullptr) {
+    setPrevFree(nextFree(block), prevFree(block));
+  }
+
+  // Next fit resumes from the following free block.
+  if (block == searchRover) {
+    searchRover = nextFree(block);
+  }
+
+  if (searchMode == SearchMode::SegregatedFit && head == nullptr) {
+    nonEmptyClasses &= ~(uint64_t(1) << sizeClass(getSize(block)));
+  }
+
+  if (searchMode == SearchMode::TLSF && head == nullptr) {
+    size_t fl, sl;
+    tlsfMapping(getSize(block), fl, sl);
+    tlsfSecondLevelMasks[fl] &= ~(uint32_t(1) << sl);
+    if (tlsfSecondLevelMasks[fl] == 0) {
+      tlsfFirstLevelMask &= ~(uint32_t(1) << fl);
+    }
+  }
+}
+
+/**
+ * First-fit algorithm.
+ *
+ * Returns the first free block which fits the size.
+ */
+Block* firstFit(size_t alignedSize)
 {
   // The first found block is returned,
   // even if it’s much larger in size than requested.
-  // We’ll fix this below with the next- and best-fit allocations.
-  Block* block = heapStart;
-  while (block != nullptr)
+  // Only free blocks are visited: used ones are not in the list.
+  for (Block* block = freeList; block != nullptr; block = nextFree(block))
   {
-    // O(n) search
-    if (block->used || block->size < alignedSize)
+    if (getSize(block) >= alignedSize)
     {
-      block = block->next;
-      continue;
+      return block;
     }
-
-    return block;
   }
 
   return nullptr;
@@ -198,45 +985,27 @@ Block* firstFit(size_t alignedSize)
  */
 Block* nextFit(size_t alignedSize)
 {
-  // The circular first fit
-  // even if it’s much larger in size than requested.
-  // We’ll fix this below with the next- and best-fit allocations.
-  Block* block = searchStart == nullptr ? heapStart : searchStart;
-  if (block == nullptr) return nullptr;
+  // The circular first fit, starting where the previous search stopped.
+  Block* start = searchRover != nullptr ? searchRover : freeList;
+  if (start == nullptr) return nullptr;
 
-  while (true)
+  Block* block = start;
+  do
   {
-    // If current block is not re-usable;
-    // O(n) search
-    if (block->used || block->size < alignedSize)
+    if (getSize(block) >= alignedSize)
     {
-      // Move to next or to heap start if already completed
-      block = block->next;
-      if (block == nullptr)
-      {
-        // If found nothing previously then we should stop here
-        // otherwise it would cause an infinite loop
-        if (searchStart == nullptr)
-        {
-          return nullptr;
-        }
-
-        block = heapStart;
-      }
-
-      // If next is search start then we already completed a circular iteration
-      if (block == searchStart)
-      {
-        return nullptr;
-      }
-
-      // Continue if still valid
-      continue;
+      searchStart = block; // Store the last found block to start from here later
+      searchRover = nextFree(block);
+      return block;
     }
 
-    searchStart = block; // Store the last found block to start from here later
-    return block;
-  }
+    // Move to next or to the list head if already completed
+    block = nextFree(block);
+    if (block == nullptr)
+    {
+      block = freeList;
+    }
+  } while (block != start); // Completed a circular iteration
 
   return nullptr;
 }
@@ -247,38 +1016,115 @@ Block* nextFit(size_t alignedSize)
  * Returns a free block which size fits the best.
  */
 Block* bestFit(size_t alignedSize) {
-  // The first found block is returned,
-  // even if it’s much larger in size than requested.
-  // We’ll fix this below with the next- and best-fit allocations.
-  Block* block = heapStart;
   Block* bestFitBlock = nullptr;
 
-  while (block != nullptr)
+  for (Block* block = freeList; block != nullptr; block = nextFree(block))
   {
-    // O(n) search
-    if (block->used || block->size < alignedSize)
+    if (getSize(block) < alignedSize)
     {
-      block = block->next;
       continue;
     }
 
     // If best fit return immediatly
-    if (block->size == alignedSize)
+    if (getSize(block) == alignedSize)
     {
       return block;
     }
 
     // Search smaller fit
-    if (bestFitBlock == nullptr || block->size < bestFitBlock->size)
+    if (bestFitBlock == nullptr || getSize(block) < getSize(bestFitBlock))
     {
       bestFitBlock = block;
-      block = block->next;
     }
   }
   
   return bestFitBlock;
 }
 
+/**
+ * Segregated-fit algorithm.
+ *
+ * Looks only at free blocks of a suitable size class.
+ */
+Block* segregatedFit(size_t alignedSize) {
+  size_t index = sizeClass(alignedSize);
+
+  // Blocks of an exact class (or of a power-of-two class above the
+  // requested one) always fit, but the requested power-of-two class
+  // may contain smaller blocks, so that one list is searched.
+  if (index >= kExactClasses) {
+    for (Block* block = segregatedLists[index]; block != nullptr; block = nextFree(block)) {
+      if (getSize(block) >= alignedSize) {
+        return block;
+      }
+    }
+
+    index++;
+  }
+
+  // O(1): first non-empty class from `index` on.
+  uint64_t candidates = index < 64 ? nonEmptyClasses & (~uint64_t(0) << index) : 0;
+  if (candidates == 0) {
+    return nullptr;
+  }
+
+  return segregatedLists[__builtin_ctzll(candidates)];
+}
+
+/**
+ * Best-fit algorithm over the tree.
+ *
+ * Returns the smallest free block which fits the size (the lowest
+ * address among equal sizes) in O(log n).
+ */
+Block* bestFitTree(size_t alignedSize) {
+  Block* bestFitBlock = nullptr;
+  Block* node = freeTree;
+
+  while (node != nullptr) {
+    if (getSize(node) >= alignedSize) {
+      bestFitBlock = node;
+      node = treeLeft(node);
+    } else {
+      node = treeRight(node);
+    }
+  }
+
+  return bestFitBlock;
+}
+
+/**
+ * TLSF algorithm.
+ *
+ * Rounds the size up to the next list boundary, so that any block of
+ * the found list fits, and finds the first non-empty list from there
+ * with two count-trailing-zeros: O(1) in the worst case.
+ */
+Block* tlsfFit(size_t alignedSize) {
+  if (alignedSize >= kTlsfSmallSize) {
+    size_t log2 = 63 - __builtin_clzll(alignedSize);
+    alignedSize += (size_t(1) << (log2 - kTlsfSecondLevelBits)) - 1;
+  }
+
+  size_t fl, sl;
+  tlsfMapping(alignedSize, fl, sl);
+
+  // The rest of the same first level...
+  uint32_t slMask = tlsfSecondLevelMasks[fl] & (~uint32_t(0) << sl);
+  if (slMask == 0) {
+    // ...or any list of the next non-empty first level.
+    uint32_t flMask = fl + 1 < kTlsfFirstLevels ? tlsfFirstLevelMask & (~uint32_t(0) << (fl + 1)) : 0;
+    if (flMask == 0) {
+      return nullptr;
+    }
+
+    fl = __builtin_ctz(flMask);
+    slMask = tlsfSecondLevelMasks[fl];
+  }
+
+  return tlsfLists[fl][__builtin_ctz(slMask)];
+}
+
 /**
  * Tries to find a block of a needed size.
  */
@@ -292,40 +1138,707 @@ Block* findBlock(size_t alignedSize)
     return nextFit(alignedSize);
   case SearchMode::BestFit:
     return bestFit(alignedSize);
+  case SearchMode::SegregatedFit:
+    return segregatedFit(alignedSize);
+  case SearchMode::BestFitTree:
+    return bestFitTree(alignedSize);
+  case SearchMode::TLSF:
+    return tlsfFit(alignedSize);
+  case SearchMode::Buddy:
+    // Allocated in the buddy arena, see `buddyAlloc`.
+    break;
+  }
+
+  return nullptr;
+}
+
+/**
+ * Whether the next block in the chain is physically adjacent
+ * (the chain may jump over memory we don't own).
+ */
+inline bool nextIsAdjacent(Block* block) {
+  return block->next != nullptr
+      && (char*)block->next == (char*)block + allocSize(getSize(block));
+}
+
+/**
+ * Whether the next block in the chain is free and physically adjacent.
+ */
+inline bool canMergeNext(Block* block) {
+  return nextIsAdjacent(block) && !isUsed(block->next);
+}
+
+/**
+ * Keeps the prev-used bit of the physical successor in sync.
+ */
+inline void updateNextPrevUsed(Block* block) {
+  if (nextIsAdjacent(block)) {
+    setPrevUsed(block->next, isUsed(block));
+  }
+}
+
+/**
+ * Splits the block on two, returns the pointer to the first sub-block
+ * of `size` bytes. The remainder becomes a new free block linked
+ * right after it.
+ */
+Block* split(Block* block, size_t size) {
+  size_t newBlockSize = getSize(block) - allocSize(size);
+
+  Block* freePart = (Block*)((char*)block + allocSize(size));
+  freePart->sizeAndFlags = newBlockSize;
+
+  // Chain the blocks
+  freePart->next = block->next;
+  block->next = freePart;
+  if (top == block) {
+    top = freePart;
+  }
+
+  setSize(block, size);
+  setFooter(freePart);
+  insertFree(freePart);
+
+  return block;
+}
+ 
+/**
+ * Whether this block can be split: the remainder should
+ * be at least `minSplitRemainder` bytes of payload.
+ */
+inline bool canSplit(Block *block, size_t size) {
+  return getSize(block) >= allocSize(size) + minSplitRemainder;
+}
+ 
+/**
+ * Allocates a block from the free list, splitting if needed.
+ */
+Block* listAllocate(Block* block, size_t size) {
+  removeFree(block);
+
+  // Split the larger block, reusing the free part.
+  if (canSplit(block, size)) {
+    block = split(block, size);
+  }
+ 
+  setUsed(block, true);
+  updateNextPrevUsed(block);
+ 
+  return block;
+}
+
+/**
+ * Absorbs the next block, which is already unlinked from the free list.
+ * Only free blocks are merged, so the footer is rewritten.
+ */
+void mergeNext(Block* block) {
+  Block* next = block->next;
+  setSize(block, getSize(block) + allocSize(getSize(next)));
+  block->next = next->next;
+  if (top == next) {
+    top = block;
+  }
+  setFooter(block);
+}
+
+/**
+ * Returns the physical predecessor if it is free. Its footer
+ * is only read when the prev-used bit says it's free.
+ */
+inline Block* freePrev(Block* block) {
+  if (isPrevUsed(block)) {
+    return nullptr;
+  }
+
+  word_t tag = ((word_t*)block)[-1];
+  return (Block*)((char*)block - allocSize(tag));
+}
+
+/**
+ * Merges a free block (not in the free list) with its free neighbours,
+ * returns the resulting block.
+ */
+Block* coalesce(Block* block) {
+  if (canMergeNext(block)) {
+    removeFree(block->next);
+    mergeNext(block);
+  }
+
+  if (Block* prev = freePrev(block)) {
+    removeFree(prev);
+    mergeNext(prev);
+    block = prev;
+  }
+
+  return block;
+}
+
+/**
+ * Deferred coalescing: merges all runs of adjacent free blocks.
+ */
+void coalesceAll() {
+  for (Block* block = heapStart; block != nullptr; block = block->next) {
+    if (isUsed(block) || !canMergeNext(block)) {
+      continue;
+    }
+
+    // The size (and so the size class) changes.
+    removeFree(block);
+    while (canMergeNext(block)) {
+      removeFree(block->next);
+      mergeNext(block);
+    }
+    insertFree(block);
+  }
+}
+
+/**
+ * Appends a fresh block to the heap chain.
+ */
+void chainBlock(Block* block) {
+  block->next = nullptr;
+
+  // The first block of a chunk has no physical predecessor.
+  bool prevAdjacent = top != nullptr
+      && (char*)top + allocSize(getSize(top)) == (char*)block;
+  setPrevUsed(block, !prevAdjacent || isUsed(top));
+
+  // Init heap
+  if (heapStart == nullptr)
+  {
+    heapStart = block;
+  }
+
+  // Chain the blocks
+  if (top != nullptr)
+  {
+    top->next = block;
+  }
+
+  top = block;
+}
+
+/**
+ * Turns the unused end of the current chunk into a free block,
+ * so it's not lost when the next chunk is mapped.
+ */
+void retireChunkTail() {
+  size_t rest = chunks->end - chunks->bump;
+  if (rest < allocSize(kMinPayloadSize)) {
+    return;
+  }
+
+  Block* block = (Block*)chunks->bump;
+  chunks->bump = chunks->end;
+
+  block->sizeAndFlags = rest - allocSize(0);
+  chainBlock(block);
+
+  if (coalesceMode == CoalesceMode::Immediate) {
+    block = coalesce(block);
+  }
+  setFooter(block);
+
+  insertFree(block);
+}
+
+/**
+ * First block of a chunk, right after its header.
+ */
+inline Block* firstBlock(Chunk* chunk) {
+  return (Block*)(chunk + 1);
+}
+
+/**
+ * Returns the chunk this block starts, or nullptr. The word before
+ * a header may be user data, so the chunks are searched instead.
+ */
+Chunk* chunkStartingAt(Block* block) {
+  for (Chunk* chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+    if (firstBlock(chunk) == block) {
+      return chunk;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Maps a new chunk with room for at least `needed` bytes of blocks.
+ */
+bool mapChunk(size_t needed) {
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  size_t chunkSize = sizeof(Chunk) + needed;
+  chunkSize = (chunkSize + pageSize - 1) & ~(pageSize - 1);
+  if (chunkSize < nextChunkSize) {
+    chunkSize = nextChunkSize;
+  }
+
+  void* memory = mmap(nullptr, chunkSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+
+  if (chunks != nullptr) {
+    retireChunkTail();
+  }
+
+  Chunk* chunk = (Chunk*)memory;
+  chunk->next = chunks;
+  chunk->size = chunkSize;
+  chunk->end = (char*)memory + chunkSize;
+
+  chunk->bump = (char*)firstBlock(chunk);
+
+  chunks = chunk;
+
+  if (nextChunkSize < kMaxChunkSize) {
+    nextChunkSize *= 2;
+  }
+
+  return true;
+}
+ 
+/**
+ * Requests memory from OS: bump-allocates a block in the current
+ * chunk, mapping a new one only when it's full. No syscalls
+ * on the common path.
+ */
+Block* requestFromOS(size_t size) {
+  size_t needed = allocSize(size);
+
+  // OOM. (Out Of Memory)
+  if (chunks == nullptr || chunks->bump + needed > chunks->end) {
+    if (!mapChunk(needed)) {
+      return nullptr;
+    }
+  }
+
+  Block* block = (Block*)chunks->bump;
+  chunks->bump += needed;
+ 
+  return block;
+}
+
+/**
+ * Monotonic clock in milliseconds.
+ */
+inline long nowMs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Releases the whole pages inside `[begin, end)`.
+ */
+void purgePages(char* begin, char* end) {
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  char* first = (char*)(((uintptr_t)begin + pageSize - 1) & ~(pageSize - 1));
+  char* last = (char*)((uintptr_t)end & ~(pageSize - 1));
+
+  if (first < last) {
+    madvise(first, last - first, MADV_DONTNEED);
+  }
+}
+
+/**
+ * Returns free memory to the OS:
+ *
+ *  - a free block spanning a whole chunk (other than the current one)
+ *    unmaps the chunk;
+ *  - a free top block of the current chunk goes back to the bump area,
+ *    whose pages are released (like shrinking the break);
+ *  - whole pages inside other free blocks are released, keeping the
+ *    free-list links and the footer.
+ */
+void trimHeap() {
+  Block* prev = nullptr;
+  Block* block = heapStart;
+
+  while (block != nullptr) {
+    Block* next = block->next;
+
+    if (isUsed(block)) {
+      prev = block;
+      block = next;
+      continue;
+    }
+
+    char* end = (char*)block + allocSize(getSize(block));
+    Chunk* chunk = chunkStartingAt(block);
+
+    bool wholeChunk = chunk != nullptr && chunk != chunks && end == chunk->bump;
+    bool chunkTop = block == top && end == chunks->bump;
+
+    if (!wholeChunk && !chunkTop) {
+      purgePages((char*)(block->data + 2), (char*)getFooter(block));
+      prev = block;
+      block = next;
+      continue;
+    }
+
+    // Unlink from the heap chain and the free list.
+    removeFree(block);
+    if (prev == nullptr) {
+      heapStart = next;
+    } else {
+      prev->next = next;
+    }
+    if (top == block) {
+      top = prev;
+    }
+
+    if (wholeChunk) {
+      Chunk** link = &chunks;
+      while (*link != chunk) {
+        link = &(*link)->next;
+      }
+      *link = chunk->next;
+      munmap(chunk, chunk->size);
+    } else {
+      chunks->bump = (char*)block;
+      purgePages(chunks->bump, chunks->end);
+    }
+
+    block = next;
+  }
+
+  dirtyBytes = 0;
+}
+
+/**
+ * Trims the heap once enough memory stayed dirty long enough.
+ */
+void maybeTrim() {
+  if (dirtyBytes >= trimThreshold && nowMs() - dirtySince >= dirtyDecayMs) {
+    trimHeap();
+  }
+}
+
+/**
+ * Buddy allocator: the header is the only overhead (no footer),
+ * the payload size is 2^order minus the header.
+ */
+static constexpr size_t kBuddyHeaderSize = sizeof(Block) - sizeof(std::declval<Block>().data);
+
+/**
+ * Without a footer, a free buddy only stores its two links.
+ */
+static constexpr size_t kBuddyMinPayloadSize = 2 * sizeof(word_t);
+
+inline size_t buddyOrder(Block* block) {
+  return 63 - __builtin_clzll(getSize(block) + kBuddyHeaderSize);
+}
+
+inline bool inBuddyArena(Block* block) {
+  return buddyArena != nullptr && (char*)block >= buddyArena
+      && (char*)block < buddyArena + (size_t(1) << kBuddyMaxOrder);
+}
+
+void buddyPush(Block* block, size_t order) {
+  block->sizeAndFlags = (size_t(1) << order) - kBuddyHeaderSize;
+  block->next = nullptr;
+
+  setPrevFree(block, nullptr);
+  setNextFree(block, buddyLists[order]);
+  if (buddyLists[order] != nullptr) {
+    setPrevFree(buddyLists[order], block);
+  }
+  buddyLists[order] = block;
+  buddyNonEmptyOrders |= uint64_t(1) << order;
+}
+
+void buddyUnlink(Block* block, size_t order) {
+  if (prevFree(block) != nullptr) {
+    setNextFree(prevFree(block), nextFree(block));
+  } else {
+    buddyLists[order] = nextFree(block);
+  }
+
+  if (nextFree(block) != nullptr) {
+    setPrevFree(nextFree(block), prevFree(block));
+  }
+
+  if (buddyLists[order] == nullptr) {
+    buddyNonEmptyOrders &= ~(uint64_t(1) << order);
+  }
+}
+
+/**
+ * Rounds the request up to a power of two, and splits the smallest
+ * free block which fits down to it: O(log n).
+ */
+Block* buddyAlloc(size_t size) {
+  if (buddyArena == nullptr) {
+    void* memory = mmap(nullptr, size_t(1) << kBuddyMaxOrder, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+      return nullptr;
+    }
+
+    buddyArena = (char*)memory;
+    buddyPush((Block*)buddyArena, kBuddyMaxOrder);
+  }
+
+  size_t order = 64 - __builtin_clzll(size + kBuddyHeaderSize - 1);
+  if (order < kBuddyMinOrder) {
+    order = kBuddyMinOrder;
+  }
+  if (order > kBuddyMaxOrder) {
+    return nullptr;
+  }
+
+  uint64_t candidates = buddyNonEmptyOrders & (~uint64_t(0) << order);
+  if (candidates == 0) {
+    return nullptr;
+  }
+
+  size_t found = __builtin_ctzll(candidates);
+  Block* block = buddyLists[found];
+  buddyUnlink(block, found);
+
+  // The upper halves go back to the free lists.
+  while (found > order) {
+    found--;
+    buddyPush((Block*)((char*)block + (size_t(1) << found)), found);
+  }
+
+  block->sizeAndFlags = ((size_t(1) << order) - kBuddyHeaderSize) | kUsed;
+  block->next = nullptr;
+
+  return block;
+}
+
+/**
+ * Merges the block with its buddy (found by XOR-ing the offset with
+ * the block size) for as long as the buddy is free: O(log n).
+ */
+void buddyFree(Block* block) {
+  size_t order = buddyOrder(block);
+
+  while (order < kBuddyMaxOrder) {
+    size_t offset = (char*)block - buddyArena;
+    Block* buddy = (Block*)(buddyArena + (offset ^ (size_t(1) << order)));
+
+    // The buddy may be used, or split into smaller blocks.
+    if (isUsed(buddy) || buddyOrder(buddy) != order) {
+      break;
+    }
+
+    buddyUnlink(buddy, order);
+    if (buddy < block) {
+      block = buddy;
+    }
+    order++;
+  }
+
+  buddyPush(block, order);
+}
+
+/**
+ * Returns the slab of an object (the `getHeader` of slab objects).
+ */
+inline Slab* getSlab(word_t* data) {
+  return (Slab*)((uintptr_t)data & ~(kSlabSize - 1));
+}
+
+inline bool inSlabRegion(word_t* data) {
+  return slabRegion != nullptr && (char*)data >= slabRegion
+      && (char*)data < slabRegion + kSlabRegionSize;
+}
+
+/**
+ * Free objects of a slab are linked through their first word.
+ */
+inline word_t* nextObject(word_t* object) {
+  word_t* next;
+  memcpy(&next, object, sizeof(next));
+  return next;
+}
+
+inline void setNextObject(word_t* object, word_t* next) {
+  memcpy(object, &next, sizeof(next));
+}
+
+/**
+ * Returns the size class of a slab object size.
+ */
+inline size_t slabClass(size_t alignedSize) {
+  size_t index = 0;
+  while (kSlabClassSizes[index] < alignedSize) {
+    index++;
+  }
+  return index;
+}
+
+void pushSlab(Slab*& list, Slab* slab) {
+  slab->prev = nullptr;
+  slab->next = list;
+  if (list != nullptr) {
+    list->prev = slab;
+  }
+  list = slab;
+}
+
+void unlinkSlab(Slab*& list, Slab* slab) {
+  if (slab->prev != nullptr) {
+    slab->prev->next = slab->next;
+  } else {
+    list = slab->next;
+  }
+
+  if (slab->next != nullptr) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+/**
+ * Takes an empty slab (reused or bumped from the region),
+ * and threads its free list for the size class.
+ */
+Slab* newSlab(size_t index) {
+  if (slabRegion == nullptr) {
+    void* memory = mmap(nullptr, kSlabRegionSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+      return nullptr;
+    }
+
+    slabRegion = slabBump = (char*)memory;
+  }
+
+  Slab* slab = emptySlabs;
+  if (slab != nullptr) {
+    unlinkSlab(emptySlabs, slab);
+  } else if (slabBump + kSlabSize <= slabRegion + kSlabRegionSize) {
+    slab = (Slab*)slabBump;
+    slabBump += kSlabSize;
+  } else {
+    return nullptr;
+  }
+
+  slab->objectSize = kSlabClassSizes[index];
+  slab->used = 0;
+  slab->freeObjects = nullptr;
+
+  // In address order: the first object is handed out first.
+  char* first = (char*)slab + align(sizeof(Slab));
+  size_t count = ((char*)slab + kSlabSize - first) / slab->objectSize;
+  for (size_t i = count; i > 0; i--) {
+    word_t* object = (word_t*)(first + (i - 1) * slab->objectSize);
+    setNextObject(object, slab->freeObjects);
+    slab->freeObjects = object;
+  }
+
+  pushSlab(partialSlabs[index], slab);
+  return slab;
+}
+
+/**
+ * Allocates a small object: pops the free list of a partial slab.
+ * Returns nullptr when the slab region is exhausted.
+ */
+word_t* slabAlloc(size_t alignedSize) {
+  size_t index = slabClass(alignedSize);
+
+  Slab* slab = partialSlabs[index];
+  if (slab == nullptr && (slab = newSlab(index)) == nullptr) {
+    return nullptr;
+  }
+
+  word_t* object = slab->freeObjects;
+  slab->freeObjects = nextObject(object);
+  slab->used++;
+
+  // Full slabs leave the partial list until an object is freed.
+  if (slab->freeObjects == nullptr) {
+    unlinkSlab(partialSlabs[index], slab);
+  }
+
+  return object;
+}
+
+/**
+ * Frees a small object. A slab which becomes empty is released
+ * (unless it's the last partial one of its class, to avoid churn).
+ */
+void slabFree(word_t* data) {
+  Slab* slab = getSlab(data);
+  size_t index = slabClass(slab->objectSize);
+
+  bool wasFull = slab->freeObjects == nullptr;
+  setNextObject(data, slab->freeObjects);
+  slab->freeObjects = data;
+  slab->used--;
+
+  if (wasFull) {
+    pushSlab(partialSlabs[index], slab);
+  }
+
+  if (slab->used == 0 && (slab->prev != nullptr || slab->next != nullptr)) {
+    unlinkSlab(partialSlabs[index], slab);
+    pushSlab(emptySlabs, slab);
+  }
+}
+
+/**
+ * Maps a large object on its own.
+ */
+Block* allocLarge(size_t size) {
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  size_t mappedSize = sizeof(LargeObject) + allocSize(size);
+  mappedSize = (mappedSize + pageSize - 1) & ~(pageSize - 1);
+
+  void* memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  LargeObject* object = (LargeObject*)memory;
+  object->size = mappedSize;
+  object->prev = nullptr;
+  object->next = largeObjects;
+  if (largeObjects != nullptr) {
+    largeObjects->prev = object;
   }
+  largeObjects = object;
 
-  return nullptr;
+  Block* block = (Block*)(object + 1);
+  block->sizeAndFlags = size | kUsed | kPrevUsed;
+  block->next = (Block*)kLargeObjectTag;
+
+  return block;
 }
 
 /**
- * Splits the block on two, returns the pointer to the smaller sub-block.
+ * Unlinks a large object and returns its memory to the OS.
  */
-Block* split(Block* block, size_t size) {
-  size_t newBlockSize = block->size - allocSize(size);
+void freeLarge(Block* block) {
+  LargeObject* object = (LargeObject*)block - 1;
 
-  return nullptr;
-}
- 
-/**
- * Whether this block can be split.
- */
-inline bool canSplit(Block *block, size_t size) {
-  return block->size > size;
+  if (object->prev != nullptr) {
+    object->prev->next = object->next;
+  } else {
+    largeObjects = object->next;
+  }
+
+  if (object->next != nullptr) {
+    object->next->prev = object->prev;
+  }
+
+  munmap(object, object->size);
 }
- 
+
 /**
- * Allocates a block from the list, splitting if needed.
+ * Whether the block is a large object (see `kLargeObjectTag`).
  */
-Block* listAllocate(Block* block, size_t size) {
-  // Split the larger block, reusing the free part.
-  if (canSplit(block, size)) {
-    block = split(block, size);
-  }
- 
-  block->used = true;
-  block->size = size;
- 
-  return block;
+inline bool isLargeObject(Block* block) {
+  return (uintptr_t)block->next == kLargeObjectTag;
 }
 
 /**
@@ -342,37 +1855,89 @@ Block* listAllocate(Block* block, size_t size) {
 word_t* alloc(size_t size)
 {
   size_t alignedSize = align(size);
+  if (alignedSize < kMinPayloadSize)
+  {
+    alignedSize = kMinPayloadSize;
+  }
+
+  // ---------------------------------------------------------
+  // 0. Small objects go to the slabs, without a header
+  //    (or to a regular block once the slab region is full):
+
+  if (useSlabs && align(size) <= kMaxSlabObjectSize)
+  {
+    word_t* object = slabAlloc(align(size == 0 ? 1 : size));
+    if (object != nullptr)
+    {
+      return object;
+    }
+  }
 
   // ---------------------------------------------------------
-  // 1. Search for an available free block:
+  // 1. Large objects bypass the heap:
 
-  if (Block* block = findBlock(alignedSize))
+  if (alignedSize >= largeObjectThreshold)
   {
-    printf("Reused block at %p with size %li | req size %li and req aligned size %li \n", block, block->size, size, alignedSize);
-    block->used = true;
+    Block* block = allocLarge(alignedSize);
+    if (block == nullptr)
+    {
+      return nullptr;
+    }
+
+    printf("Mapped large object at %p with size %li\n", block, alignedSize);
     return block->data;
   }
 
   // ---------------------------------------------------------
-  // 2. If block not found in the free list, request from OS:
-  Block* block = requestFromOS(alignedSize);
-  block->size = alignedSize;
-  block->used = true;
-  printf("Allocated block at %p with size %li | aligned size: %li\n", block, size, alignedSize);
+  // 2. Buddy mode has its own arena:
 
-  // Init heap
-  if (heapStart == nullptr)
+  if (searchMode == SearchMode::Buddy)
   {
-    heapStart = block;
+    size_t buddySize = align(size);
+    if (buddySize < kBuddyMinPayloadSize)
+    {
+      buddySize = kBuddyMinPayloadSize;
+    }
+
+    Block* block = buddyAlloc(buddySize);
+    if (block == nullptr)
+    {
+      return nullptr;
+    }
+
+    printf("Buddy block at %p with size %li | req size %li\n", block, getSize(block), size);
+    return block->data;
   }
 
-  // Chain the blocks
-  if (top != nullptr)
+  // ---------------------------------------------------------
+  // 3. Search for an available free block:
+
+  Block* block = findBlock(alignedSize);
+
+  if (block == nullptr && coalesceMode == CoalesceMode::Deferred)
   {
-    top->next = block;
+    coalesceAll();
+    block = findBlock(alignedSize);
   }
 
-  top = block;
+  if (block != nullptr)
+  {
+    block = listAllocate(block, alignedSize);
+    printf("Reused block at %p with size %li | req size %li and req aligned size %li \n", block, getSize(block), size, alignedSize);
+    return block->data;
+  }
+
+  // ---------------------------------------------------------
+  // 4. If block not found in the free list, request from OS:
+  block = requestFromOS(alignedSize);
+  if (block == nullptr)
+  {
+    return nullptr;
+  }
+
+  block->sizeAndFlags = alignedSize | kUsed;
+  chainBlock(block);
+  printf("Allocated block at %p with size %li | aligned size: %li\n", block, size, alignedSize);
 
   // User payload
   return block->data;
@@ -383,13 +1948,61 @@ word_t* alloc(size_t size)
  */
 void free(word_t* data)
 {
+  // Slab objects have no header.
+  if (inSlabRegion(data)) {
+    slabFree(data);
+    return;
+  }
+
   Block* block = getHeader(data);
-  block->used = false;
-  printf("freed block at %p with size %li\n", block, block->size);
+
+  // Checked first, by address: buddy blocks have their own layout.
+  if (inBuddyArena(block)) {
+    printf("freed buddy block at %p with size %li\n", block, getSize(block));
+    buddyFree(block);
+    return;
+  }
+
+  if (isLargeObject(block)) {
+    printf("unmapped large object at %p with size %li\n", block, getSize(block));
+    freeLarge(block);
+    return;
+  }
+
+  setUsed(block, false);
+
+  if (dirtyBytes == 0) {
+    dirtySince = nowMs();
+  }
+  dirtyBytes += getSize(block);
+
+  if (coalesceMode == CoalesceMode::Immediate) {
+    block = coalesce(block);
+  }
+
+  setFooter(block);
+  updateNextPrevUsed(block);
+  insertFree(block);
+
+  printf("freed block at %p with size %li\n", block, getSize(block));
+
+  maybeTrim();
 }
 
 // #define USE_NEXT_FIT
 #define USE_BEST_FIT
+#define USE_SEGREGATED_FIT
+#define USE_FREE_LIST
+#define USE_SPLIT
+#define USE_COALESCE
+#define USE_COMPACT_HEADER
+#define USE_CHUNKS
+#define USE_LARGE_OBJECTS
+#define USE_TRIM
+#define USE_BEST_FIT_TREE
+#define USE_TLSF
+#define USE_BUDDY
+#define USE_SLABS
 
 int main()
 {
@@ -416,7 +2029,7 @@ int main()
   auto o3 = alloc(16);
   
   // Start position from o3:
-  assert(getHeader(o3)->used == true); // reused block should be marked as used
+  assert(isUsed(getHeader(o3)) == true); // reused block should be marked as used
   assert(searchStart == getHeader(o3));
   
   // [[8, 1], [8, 1], [8, 1], [16, 1], [16, 1]]
@@ -450,11 +2063,613 @@ int main()
   
   // [[8, 1], [64, 0], [8, 1], [16, 1]]
   
-  // Reuse 64, splitting it to 16, and 48
+  // Reuse 64, splitting it to 24 (the minimum payload), and 24
+  // (the remainder pays for its own header):
   z3 = alloc(16);
   assert(getHeader(z3) == getHeader(z1));
+  assert(getSize(getHeader(z3)) == kMinPayloadSize);
+  assert(getSize(getHeader(z3)->next) == 64 - allocSize(kMinPayloadSize));
+  assert(isUsed(getHeader(z3)->next) == false);
   
-  // [[8, 1], [16, 1], [48, 0], [8, 1], [16, 1]]
+  // [[8, 1], [24, 1], [24, 0], [8, 1], [16, 1]]
+#endif
+
+#ifdef USE_SEGREGATED_FIT
+  // --------------------------------------
+  // Test case 7: Segregated-fit search
+  //
+  init(SearchMode::SegregatedFit);
+
+  // [[8, 1], [64, 1], [8, 1], [16, 1], [8, 1], [304, 1]]
+  alloc(8);
+  auto s1 = alloc(64);
+  alloc(8);
+  auto s2 = alloc(16);
+  alloc(8);
+  auto s3 = alloc(300);
+
+  // [[8, 1], [64, 0], [8, 1], [16, 0], [8, 1], [304, 0]]
+  free(s1);
+  free(s2);
+  free(s3);
+
+  // Exact class 16 is taken from its list head:
+  auto s4 = alloc(16);
+  assert(getHeader(s4) == getHeader(s2));
+
+  // 260 lives in the (256, 512] class together with 304:
+  auto s5 = alloc(260);
+  assert(getHeader(s5) == getHeader(s3));
+
+  // Class 40 is empty, the next non-empty one is 64:
+  auto s6 = alloc(40);
+  assert(getHeader(s6) == getHeader(s1));
+
+  // Nothing free left, a new block is requested:
+  auto s7 = alloc(16);
+  assert(getHeader(s7) != getHeader(s1) && getHeader(s7) != getHeader(s2));
+  assert(nonEmptyClasses == 0);
+#endif
+
+#ifdef USE_FREE_LIST
+  // --------------------------------------
+  // Test case 8: Explicit free list
+  //
+  // Only free blocks are linked, used ones are never visited.
+  //
+  init(SearchMode::FirstFit);
+
+  word_t* objects[10];
+  for (auto& object : objects) {
+    object = alloc(16);
+  }
+
+  // [[16, 1], [16, 0], [16, 1], ..., [16, 1], [16, 0]]
+  free(objects[1]);
+  free(objects[9]);
+
+  // LIFO order: the last freed block is the list head.
+  assert(freeList == getHeader(objects[9]));
+  assert(nextFree(freeList) == getHeader(objects[1]));
+  assert(nextFree(getHeader(objects[1])) == nullptr);
+  assert(prevFree(getHeader(objects[1])) == freeList);
+
+  auto f1 = alloc(16);
+  assert(getHeader(f1) == getHeader(objects[9]));
+  assert(freeList == getHeader(objects[1]));
+  assert(prevFree(freeList) == nullptr);
+
+  auto f2 = alloc(16);
+  assert(getHeader(f2) == getHeader(objects[1]));
+  assert(freeList == nullptr);
+#endif
+
+#ifdef USE_SPLIT
+  // --------------------------------------
+  // Test case 9: Block splitting
+  //
+  init(SearchMode::FirstFit);
+
+  // [[128, 1], [24, 1]]
+  auto b1 = alloc(128);
+  auto b2 = alloc(24);
+  free(b1);
+
+  // [[24, 1], [88, 0], [24, 1]]
+  auto b3 = alloc(24);
+  Block* rest = getHeader(b3)->next;
+  assert(getHeader(b3) == getHeader(b1));
+  assert(getSize(getHeader(b3)) == 24);
+  assert(getSize(rest) == 128 - allocSize(24) && isUsed(rest) == false);
+  assert(rest->next == getHeader(b2));
+  assert(freeList == rest);
+
+  // 88 - allocSize(24) = 48 is less than the threshold, so the
+  // whole block is used: [[24, 1], [88, 1], [24, 1]]
+  setMinSplitRemainder(128);
+  auto b4 = alloc(24);
+  assert(getHeader(b4) == rest);
+  assert(getSize(rest) == 128 - allocSize(24) && freeList == nullptr);
+  setMinSplitRemainder(kMinPayloadSize);
+#endif
+
+#ifdef USE_COALESCE
+  // --------------------------------------
+  // Test case 10: Immediate coalescing
+  //
+  init(SearchMode::FirstFit);
+
+  // [[24, 1], [24, 1], [24, 1], [24, 1]]
+  auto c1 = alloc(24);
+  auto c2 = alloc(24);
+  auto c3 = alloc(24);
+  auto c4 = alloc(24);
+
+  // Merge with the next block: [[24, 1], [64, 0], [24, 1]]
+  free(c3);
+  free(c2);
+  assert(getSize(getHeader(c2)) == 24 + allocSize(24));
+  assert(getHeader(c2)->next == getHeader(c4));
+  assert(*getFooter(getHeader(c2)) == (word_t)getSize(getHeader(c2)));
+
+  // Merge with the previous block: [[104, 0], [24, 1]]
+  free(c1);
+  assert(getSize(getHeader(c1)) == 24 + 2 * allocSize(24));
+  assert(freeList == getHeader(c1) && nextFree(freeList) == nullptr);
+
+  // Merge with both neighbours: [[144, 0]]
+  free(c4);
+  assert(getSize(getHeader(c1)) == 24 + 3 * allocSize(24));
+  assert(getHeader(c1)->next == nullptr && top == getHeader(c1));
+
+  // --------------------------------------
+  // Test case 11: Deferred coalescing
+  //
+  init(SearchMode::FirstFit, CoalesceMode::Deferred);
+
+  // [[24, 0], [24, 0], [24, 1]]
+  auto d1 = alloc(24);
+  auto d2 = alloc(24);
+  alloc(24);
+  free(d1);
+  free(d2);
+  assert(getSize(getHeader(d1)) == 24);
+
+  // No single block fits 48, merging on the miss: [[64, 1], [24, 1]]
+  auto d3 = alloc(48);
+  assert(getHeader(d3) == getHeader(d1));
+  assert(getSize(getHeader(d3)) == 24 + allocSize(24));
+#endif
+
+#ifdef USE_COMPACT_HEADER
+  // --------------------------------------
+  // Test case 12: Flags in the low bits of the size
+  //
+  // Header is 16 bytes: size + flags, and the next pointer. The
+  // struct also counts the first payload word: 16 + 8.
+  //
+  assert(sizeof(Block) == 24);
+
+  // Used blocks have no footer: just the header on top of the payload.
+  assert(allocSize(24) == 16 + 24);
+
+  init(SearchMode::FirstFit);
+
+  // [[24, 1], [24, 1], [24, 1]]
+  auto h1 = alloc(24);
+  auto h2 = alloc(24);
+  auto h3 = alloc(24);
+  Block* hb = getHeader(h2);
+
+  assert(isUsed(hb) && isPrevUsed(hb) && !isMarked(hb));
+  assert(getSize(hb) == 24);
+
+  setMarked(hb, true);
+  assert(isMarked(hb) && isUsed(hb) && getSize(hb) == 24);
+  setMarked(hb, false);
+
+  // [[24, 0], [24, 1], [24, 1]]
+  free(h1);
+  assert(!isPrevUsed(hb) && isUsed(hb));
+  assert(isPrevUsed(getHeader(h3)));
+
+  // [[24, 1], [24, 1], [24, 1]]
+  auto h4 = alloc(24);
+  assert(getHeader(h4) == getHeader(h1));
+  assert(isPrevUsed(hb));
+
+  // The last word of a used block is user data, not a footer: freeing
+  // the successor doesn't read it, even if it looks like a size.
+  h4[2] = 24;
+  free(h2);
+  assert(isUsed(getHeader(h4)) && getSize(getHeader(h4)) == 24);
+  assert(getSize(hb) == 24 && !isPrevUsed(getHeader(h3)));
+#endif
+
+#ifdef USE_CHUNKS
+  // --------------------------------------
+  // Test case 13: Blocks are bump-allocated in mapped chunks
+  //
+  init(SearchMode::FirstFit);
+  setLargeObjectThreshold(kMaxChunkSize);
+
+  auto m1 = alloc(24);
+  auto m2 = alloc(24);
+  Chunk* firstChunk = chunks;
+  assert(firstChunk->size == kMinChunkSize);
+  assert((char*)getHeader(m1) == (char*)(firstChunk + 1));
+  assert((char*)getHeader(m2) == (char*)getHeader(m1) + allocSize(24));
+
+  // Doesn't fit the first chunk: the next one is twice as big,
+  // and the rest of the first chunk becomes a free block.
+  auto m3 = alloc(kMinChunkSize);
+  assert(chunks != firstChunk && chunks->next == firstChunk);
+  assert(chunks->size == 2 * kMinChunkSize);
+  assert((char*)getHeader(m3) == (char*)(chunks + 1));
+
+  Block* tail = getHeader(m2)->next;
+  assert(!isUsed(tail) && tail->next == getHeader(m3));
+  assert((char*)tail + allocSize(getSize(tail)) == firstChunk->end);
+
+  // The tail is reused first.
+  auto m4 = alloc(1024);
+  assert(getHeader(m4) == tail);
+
+  init(SearchMode::FirstFit);
+  assert(chunks == nullptr && nextChunkSize == kMinChunkSize);
+  setLargeObjectThreshold(kDefaultLargeObjectThreshold);
+#endif
+
+#ifdef USE_LARGE_OBJECTS
+  // --------------------------------------
+  // Test case 14: Large objects are mapped on their own
+  //
+  init(SearchMode::FirstFit);
+
+  auto l0 = alloc(16);
+  auto l1 = alloc(size_t(10) << 20);
+  auto l2 = alloc(size_t(1) << 20);
+  Block* lb1 = getHeader(l1);
+
+  // Not in the heap chain, and fully usable:
+  assert(isLargeObject(lb1) && !isLargeObject(getHeader(l0)));
+  assert(getHeader(l0)->next == nullptr && top == getHeader(l0));
+  assert(getSize(lb1) == size_t(10) << 20);
+  l1[(size_t(10) << 20) / sizeof(word_t) - 1] = 42;
+
+  // [l2, l1]
+  assert(largeObjects->next->next == nullptr);
+
+  // Unmapped right away: [l2]
+  free(l1);
+  assert(largeObjects == (LargeObject*)getHeader(l2) - 1);
+  assert(largeObjects->next == nullptr && largeObjects->prev == nullptr);
+
+  free(l2);
+  assert(largeObjects == nullptr);
+  free(l0);
+
+  // Unmapped by init, even with no block in the heap chain:
+  init(SearchMode::FirstFit);
+  alloc(size_t(1) << 20);
+  assert(heapStart == nullptr && largeObjects != nullptr);
+  init(SearchMode::FirstFit);
+  assert(largeObjects == nullptr);
+#endif
+
+#ifdef USE_TRIM
+  // --------------------------------------
+  // Test case 15: Returning free memory to the OS
+  //
+  init(SearchMode::FirstFit);
+  setTrimPolicy(size_t(32) << 10, 0);
+
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  const size_t blockSize = size_t(60) << 10;
+
+  // [[60K, 1], [16, 1], [60K, 1]]
+  auto t1 = alloc(blockSize);
+  auto t2 = alloc(16);
+  auto t3 = alloc(blockSize);
+  for (size_t i = 0; i < blockSize / sizeof(word_t); i++) {
+    t1[i] = t3[i] = 1;
+  }
+
+  // Pages inside a free block in the middle are released,
+  // while the free-list links stay:
+  free(t1);
+  assert(dirtyBytes == 0);
+  unsigned char resident;
+  char* page = (char*)(((uintptr_t)t1 + 2 * pageSize) & ~(pageSize - 1));
+  mincore(page, pageSize, &resident);
+  assert((resident & 1) == 0);
+  assert(freeList == getHeader(t1) && nextFree(freeList) == nullptr);
+
+  // The free top goes back to the bump area:
+  char* bumpBefore = chunks->bump;
+  free(t3);
+  assert(top == getHeader(t2));
+  assert(chunks->bump == (char*)getHeader(t3) && chunks->bump < bumpBefore);
+
+  // ...and is bump-allocated again (the free 60K is too small).
+  auto t4 = alloc(size_t(100) << 10);
+  assert(getHeader(t4) == getHeader(t3));
+
+  // Not enough dirty memory: nothing happens.
+  setTrimPolicy(size_t(1) << 20, 0);
+  free(t4);
+  assert(top == getHeader(t4) && dirtyBytes == getSize(getHeader(t4)));
+  setTrimPolicy(size_t(1) << 20, 10000);
+
+  // A chunk which became a single free block is unmapped
+  // (trimming can also be requested explicitly).
+  init(SearchMode::FirstFit);
+  setLargeObjectThreshold(kMaxChunkSize);
+
+  auto u1 = alloc(16);
+  auto u2 = alloc(kMinChunkSize);
+  assert(chunks->next != nullptr);
+
+  free(u1);
+  trimHeap();
+  assert(chunks->next == nullptr);
+  assert(heapStart == getHeader(u2) && freeList == nullptr);
+
+  setLargeObjectThreshold(kDefaultLargeObjectThreshold);
+#endif
+
+#ifdef USE_BEST_FIT_TREE
+  // --------------------------------------
+  // Test case 16: Best-fit search over a balanced tree
+  //
+  init(SearchMode::BestFitTree);
+
+  // [[64, 1], [16, 1], [32, 1], [16, 1], [32, 1], [16, 1], [128, 1], [16, 1]]
+  auto r1 = alloc(64);
+  alloc(16);
+  auto r2 = alloc(32);
+  alloc(16);
+  auto r3 = alloc(32);
+  alloc(16);
+  auto r4 = alloc(128);
+  alloc(16);
+
+  free(r4);
+  free(r3);
+  free(r1);
+  free(r2);
+  assert(checkTree(freeTree) > 0);
+
+  // Smallest fit, the lower address among equal sizes:
+  assert(bestFitTree(24) == getHeader(r2));
+  assert(bestFitTree(40) == getHeader(r1));
+  assert(bestFitTree(100) == getHeader(r4));
+  assert(bestFitTree(200) == nullptr);
+
+  auto r5 = alloc(32);
+  assert(getHeader(r5) == getHeader(r2));
+  assert(bestFitTree(32) == getHeader(r3));
+
+  // Random churn, checked against a linear scan of the heap:
+  init(SearchMode::BestFitTree);
+  srand(42);
+
+  word_t* live[256];
+  for (auto& object : live) {
+    object = alloc(16 + (rand() % 64) * sizeof(word_t));
+  }
+
+  for (int round = 0; round < 1000; round++) {
+    size_t i = rand() % 256;
+    if (live[i] != nullptr) {
+      free(live[i]);
+      live[i] = nullptr;
+      assert(checkTree(freeTree) >= 0);
+      continue;
+    }
+
+    size_t request = 16 + (rand() % 64) * sizeof(word_t);
+
+    Block* expected = nullptr;
+    for (Block* block = heapStart; block != nullptr; block = block->next) {
+      if (!isUsed(block) && getSize(block) >= request &&
+          (expected == nullptr || treeLess(block, expected))) {
+        expected = block;
+      }
+    }
+    assert(bestFitTree(request) == expected);
+
+    live[i] = alloc(request);
+    assert(checkTree(freeTree) >= 0);
+  }
+#endif
+
+#ifdef USE_TLSF
+  // --------------------------------------
+  // Test case 17: Two-level segregated fit
+  //
+  size_t fl, sl;
+
+  // Small sizes in steps of a word, then 16 lists per power of two:
+  tlsfMapping(48, fl, sl);
+  assert(fl == 0 && sl == 6);
+  tlsfMapping(128, fl, sl);
+  assert(fl == 1 && sl == 0);
+  tlsfMapping(200, fl, sl);
+  assert(fl == 1 && sl == 9);
+  tlsfMapping(1000, fl, sl);
+  assert(fl == 3 && sl == 15);
+
+  init(SearchMode::TLSF);
+
+  // [[200, 1], [16, 1], [1000, 1], [16, 1], [48, 1], [16, 1]]
+  auto q1 = alloc(200);
+  alloc(16);
+  auto q2 = alloc(1000);
+  alloc(16);
+  auto q3 = alloc(48);
+  alloc(16);
+
+  free(q1);
+  free(q2);
+  free(q3);
+  assert(tlsfFirstLevelMask == 0b1011);
+
+  // 190 is rounded up to the [192, 200) list, 200 is in the next one:
+  auto q4 = alloc(190);
+  assert(getHeader(q4) == getHeader(q1));
+  assert(tlsfFirstLevelMask == 0b1001);
+
+  // Exact small list:
+  auto q5 = alloc(48);
+  assert(getHeader(q5) == getHeader(q3));
+  assert(tlsfFirstLevelMask == 0b1000);
+
+  // The 1000 block is split, the rest goes to its own list:
+  auto q6 = alloc(500);
+  assert(getHeader(q6) == getHeader(q2));
+  tlsfMapping(1000 - allocSize(500), fl, sl);
+  assert(tlsfLists[fl][sl] == getHeader(q6)->next);
+  assert(tlsfFirstLevelMask == uint32_t(1) << fl);
+
+  // Random churn: found blocks always fit.
+  init(SearchMode::TLSF);
+  srand(7);
+
+  word_t* objects2[256];
+  for (auto& object : objects2) {
+    object = alloc(16 + (rand() % 512) * sizeof(word_t));
+  }
+
+  for (int round = 0; round < 1000; round++) {
+    size_t i = rand() % 256;
+    if (objects2[i] != nullptr) {
+      free(objects2[i]);
+      objects2[i] = nullptr;
+      continue;
+    }
+
+    size_t request = 16 + (rand() % 512) * sizeof(word_t);
+    Block* found = tlsfFit(request);
+    assert(found == nullptr || getSize(found) >= request);
+
+    objects2[i] = alloc(request);
+    assert(getSize(getHeader(objects2[i])) >= request);
+  }
+#endif
+
+#ifdef USE_BUDDY
+  // --------------------------------------
+  // Test case 18: Buddy allocator
+  //
+  init(SearchMode::Buddy);
+
+  // 16 + 16 bytes of header: order 5, the second one is its buddy.
+  auto y1 = alloc(16);
+  auto y2 = alloc(16);
+  assert((char*)getHeader(y1) == buddyArena);
+  assert((char*)getHeader(y2) == buddyArena + 32);
+  assert(getSize(getHeader(y1)) == 16);
+
+  // 100 + 16: order 7, the first free one is at 128.
+  auto y3 = alloc(100);
+  assert((char*)getHeader(y3) == buddyArena + 128);
+  assert(getSize(getHeader(y3)) == 128 - kBuddyHeaderSize);
+
+  // The split left one free block of each order 6, 8, 9, ... 25:
+  assert(buddyNonEmptyOrders == (((uint64_t(1) << kBuddyMaxOrder) - (uint64_t(1) << 8)) | (uint64_t(1) << 6)));
+
+  // Freeing everything merges back to the whole arena.
+  free(y1);
+  free(y3);
+  free(y2);
+  assert(buddyNonEmptyOrders == uint64_t(1) << kBuddyMaxOrder);
+  assert(buddyLists[kBuddyMaxOrder] == (Block*)buddyArena);
+
+  // Random churn, then everything freed merges back as well.
+  srand(11);
+  word_t* buddies[128] = {};
+  for (int round = 0; round < 1000; round++) {
+    size_t i = rand() % 128;
+    if (buddies[i] != nullptr) {
+      free(buddies[i]);
+      buddies[i] = nullptr;
+    } else {
+      buddies[i] = alloc(1 + rand() % 4096);
+      assert((((char*)getHeader(buddies[i]) - buddyArena) & (getSize(getHeader(buddies[i])) + kBuddyHeaderSize - 1)) == 0);
+    }
+  }
+  for (auto object : buddies) {
+    if (object != nullptr) {
+      free(object);
+    }
+  }
+  assert(buddyNonEmptyOrders == uint64_t(1) << kBuddyMaxOrder);
+
+  // The arena is unmapped by init (there's no `heapStart` chain):
+  init(SearchMode::Buddy);
+  alloc(16);
+  assert(heapStart == nullptr && buddyArena != nullptr);
+  init(SearchMode::FirstFit);
+  assert(buddyArena == nullptr && buddyNonEmptyOrders == 0);
+#endif
+
+#ifdef USE_SLABS
+  // --------------------------------------
+  // Test case 19: Slabs for small objects
+  //
+  init(SearchMode::FirstFit);
+  enableSlabs(true);
+
+  // Same slab, no header in between:
+  auto a1 = alloc(8);
+  auto a2 = alloc(3);
+  assert(inSlabRegion(a1) && getSlab(a1) == getSlab(a2));
+  assert(a2 == a1 + 1);
+  assert(getSlab(a1)->objectSize == 8 && getSlab(a1)->used == 2);
+
+  // 40 goes to the 48 class, 100 is a regular block:
+  auto a3 = alloc(40);
+  auto a4 = alloc(100);
+  assert(getSlab(a3)->objectSize == 48 && getSlab(a3) != getSlab(a1));
+  assert(!inSlabRegion(a4) && getSize(getHeader(a4)) == 104);
+
+  // The freed object is reused first:
+  free(a1);
+  assert(getSlab(a2)->used == 1);
+  assert(alloc(8) == a1);
+
+  // A full slab leaves the partial list, a new one is started:
+  Slab* full = getSlab(alloc(64));
+  word_t* slabObjects[64];
+  for (size_t i = 0; full->freeObjects != nullptr; i++) {
+    slabObjects[i] = alloc(64);
+  }
+  assert(partialSlabs[slabClass(64)] == nullptr);
+
+  auto a5 = alloc(64);
+  assert(getSlab(a5) != full && partialSlabs[slabClass(64)] == getSlab(a5));
+
+  // ...and comes back once an object is freed.
+  free(slabObjects[0]);
+  assert(partialSlabs[slabClass(64)] == full);
+
+  // The empty slab is released, the last partial one is kept:
+  free(a5);
+  assert(emptySlabs == getSlab(a5));
+  assert(partialSlabs[slabClass(64)] == full && full->next == nullptr);
+
+  // Released slabs are reused for any class:
+  auto a6 = alloc(16);
+  assert(getSlab(a6) == getSlab(a5) && emptySlabs == nullptr);
+
+  free(a4);
+
+  // Once the region is exhausted, small objects get regular blocks:
+  char* bump = slabBump;
+  slabBump = slabRegion + kSlabRegionSize;
+  Slab* partial = partialSlabs[slabClass(32)];
+  partialSlabs[slabClass(32)] = nullptr;
+
+  auto a7 = alloc(32);
+  assert(a7 != nullptr && !inSlabRegion(a7) && getSize(getHeader(a7)) == 32);
+  free(a7);
+
+  slabBump = bump;
+  partialSlabs[slabClass(32)] = partial;
+
+  // With only slab objects (no `heapStart` chain), the slabs are
+  // still released by init:
+  init(SearchMode::FirstFit);
+  alloc(16);
+  assert(heapStart == nullptr && slabRegion != nullptr);
+  init(SearchMode::FirstFit);
+  assert(slabRegion == nullptr && emptySlabs == nullptr);
+  for (Slab* slab : partialSlabs) {
+    assert(slab == nullptr);
+  }
+
+  enableSlabs(false);
 #endif
 
   puts("\nAll assertions passed!\n");
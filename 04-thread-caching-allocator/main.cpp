@@ -0,0 +1,1297 @@
+// Writing a Memory Allocator by Dmitry Soshnikov
+// Thread-caching allocator.
+// The allocator of the previous chapter keeps its state in plain
+// globals, so it can't be used from several threads at all.
+// Here the segregated-fit heap becomes a central heap shared by
+// all threads behind locks, and each thread keeps a small cache of
+// free blocks per size class, refilled and flushed in batches:
+// most allocations and frees never take a lock. A block freed by
+// another thread is pushed back to its owner's cache with one CAS.
+// Optionally, the caches of the small classes are kept per CPU
+// instead of per thread; bigger blocks always come from the central heap.
+// http://dmitrysoshnikov.com/compilers/writing-a-memory-allocator/
+
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring> // for memcpy
+#include <cassert>
+#include <stdint.h>
+#include <unistd.h> // for sysconf
+#include <sched.h> // for sched_getcpu
+#include <sys/mman.h> // for mmap
+#include <utility> // for std::declval
+#include <atomic>
+#include <functional> // for std::hash
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Machine word size. Depending on the architecture,
+ * can be 4 or 8 bytes.
+ */
+using word_t = intptr_t;
+
+struct ThreadCache;
+
+/**
+ * Allocated block of memory. Contains the object header structure,
+ * and the actual payload pointer.
+ *
+ * Blocks of a chunk are contiguous: the physical successor is found
+ * from the size, and the predecessor from its footer.
+ */
+struct Block
+{
+
+    // -------------------------------------
+    // 1. Object header
+
+    /**
+     * Block size. Sizes are aligned by the machine word, so the
+     * low bits are always zero and keep the block flags instead.
+     */
+    size_t sizeAndFlags; // 8bytes
+
+    /**
+     * Thread cache the block was handed out from (small classes
+     * only), so a free from another thread can send it back.
+     */
+    ThreadCache* owner; // 8bytes
+
+    // -------------------------------------
+    // 2. User data
+
+    /**
+     * Payload pointer.
+     */
+    word_t data[1]; // 8bytes
+};
+
+/**
+ * Block flags, stored in the low bits of `Block::sizeAndFlags`.
+ */
+static constexpr size_t kUsed = 1; // the block is allocated (or cached)
+static constexpr size_t kFlagsMask = kUsed;
+
+inline size_t getSize(Block* block) {
+  return block->sizeAndFlags & ~kFlagsMask;
+}
+
+inline void setSize(Block* block, size_t size) {
+  block->sizeAndFlags = size | (block->sizeAndFlags & kFlagsMask);
+}
+
+inline void setFlag(Block* block, size_t flag, bool value) {
+  block->sizeAndFlags = value ? block->sizeAndFlags | flag : block->sizeAndFlags & ~flag;
+}
+
+inline bool isUsed(Block* block) {
+  return block->sizeAndFlags & kUsed;
+}
+
+inline void setUsed(Block* block, bool used) {
+  setFlag(block, kUsed, used);
+}
+
+/**
+ * Aligns the size by the machine word.
+ */
+inline size_t align(size_t n)
+{
+    return (n + sizeof(word_t) - 1) & ~(sizeof(word_t) - 1);
+}
+
+/**
+ * Minimum payload size: a free block stores two free-list links in it.
+ */
+static constexpr size_t kMinPayloadSize = 2 * sizeof(word_t);
+
+/**
+ * Object header size, without the first data word.
+ */
+static constexpr size_t kHeaderSize = sizeof(Block) - sizeof(std::declval<Block>().data);
+
+/**
+ * Returns total allocation size: the header, the payload and the footer.
+ */
+inline size_t allocSize(size_t size) {
+  return kHeaderSize + size + sizeof(word_t);
+}
+
+/**
+ * Returns the object header.
+ */
+Block* getHeader(word_t* data) {
+  return (Block*)((char*)data - kHeaderSize);
+}
+
+/**
+ * Boundary tag: the last word of each block repeats its header.
+ *
+ * There's no prev-used bit in the header here: it would be written by
+ * a neighbour's free while the owner thread reads its own header, so
+ * headers and footers are only ever written under the heap lock.
+ */
+inline word_t* getFooter(Block* block) {
+  return (word_t*)((char*)block->data + getSize(block));
+}
+
+inline void setFooter(Block* block) {
+  *getFooter(block) = block->sizeAndFlags;
+}
+
+/**
+ * Physical successor: a block, or the epilogue of the chunk.
+ */
+inline Block* physicalNext(Block* block) {
+  return (Block*)((char*)block + allocSize(getSize(block)));
+}
+
+/**
+ * Fake footer of a used, empty block. Precedes the first block of every
+ * chunk, so there is always a tag before a header.
+ */
+static constexpr word_t kFencepost = kUsed;
+
+/**
+ * Free blocks don't use their payload, so the free-list links
+ * are stored in the first two data words instead of growing the header.
+ * Copied in and out with memcpy, as in chapter 03.
+ */
+inline Block* nextFree(Block* block) {
+  Block* next;
+  memcpy(&next, &block->data[0], sizeof(next));
+  return next;
+}
+
+inline Block* prevFree(Block* block) {
+  Block* prev;
+  memcpy(&prev, (char*)block->data + sizeof(Block*), sizeof(prev));
+  return prev;
+}
+
+inline void setNextFree(Block* block, Block* next) {
+  memcpy(&block->data[0], &next, sizeof(next));
+}
+
+inline void setPrevFree(Block* block, Block* prev) {
+  memcpy((char*)block->data + sizeof(Block*), &prev, sizeof(prev));
+}
+
+// ---------------------------------------------------------
+// Central heap
+
+/**
+ * Number of exact size classes: 8, 16, 24, ..., 128 bytes.
+ */
+static constexpr size_t kExactClasses = 16;
+
+/**
+ * Largest size served by an exact class.
+ */
+static constexpr size_t kMaxExactSize = kExactClasses * sizeof(word_t);
+
+/**
+ * Number of power-of-two classes above the exact ones:
+ * (128, 256], (256, 512], ... The last one also takes everything bigger.
+ */
+static constexpr size_t kPowerOfTwoClasses = 24;
+
+/**
+ * Total number of size classes.
+ */
+static constexpr size_t kSizeClasses = kExactClasses + kPowerOfTwoClasses;
+
+/**
+ * Returns the size class of an aligned size.
+ */
+inline size_t sizeClass(size_t alignedSize) {
+  if (alignedSize <= kMaxExactSize) {
+    return alignedSize / sizeof(word_t) - 1;
+  }
+
+  size_t bits = 64 - __builtin_clzll(alignedSize - 1);
+  size_t index = kExactClasses + bits - 8;
+
+  return index < kSizeClasses ? index : kSizeClasses - 1;
+}
+
+/**
+ * Region of memory mapped from the OS. Blocks are bump-allocated
+ * in it, after the chunk header and a fencepost. A used, empty
+ * epilogue header always sits at the bump pointer, so every block
+ * has a readable physical successor.
+ */
+struct Chunk
+{
+    /**
+     * Previously mapped chunk.
+     */
+    Chunk* next;
+
+    /**
+     * Mapped size, including this header.
+     */
+    size_t size;
+
+    /**
+     * First unused byte, where the epilogue is.
+     */
+    char* bump;
+
+    /**
+     * End of the area for blocks (the epilogue word is reserved after it).
+     */
+    char* end;
+};
+
+/**
+ * Chunks grow geometrically from 1 MiB up to 64 MiB.
+ */
+static constexpr size_t kMinChunkSize = size_t(1) << 20;
+static constexpr size_t kMaxChunkSize = size_t(64) << 20;
+
+/**
+ * The heap shared by all threads: segregated free lists with splitting
+ * and coalescing over mapped chunks. Every field is guarded by `lock`.
+ */
+struct Heap
+{
+    std::mutex lock;
+
+    /**
+     * Free lists per size class, and the mask of the non-empty ones.
+     */
+    Block* lists[kSizeClasses];
+    uint64_t nonEmptyClasses;
+
+    /**
+     * Mapped chunks, the current (bump) one first.
+     */
+    Chunk* chunks;
+    size_t nextChunkSize = kMinChunkSize;
+};
+
+static Heap heap;
+
+/**
+ * Pushes a free block to the list of its size class.
+ */
+void insertFree(Block* block) {
+  size_t index = sizeClass(getSize(block));
+  Block*& head = heap.lists[index];
+
+  setPrevFree(block, nullptr);
+  setNextFree(block, head);
+  if (head != nullptr) {
+    setPrevFree(head, block);
+  }
+  head = block;
+
+  heap.nonEmptyClasses |= uint64_t(1) << index;
+}
+
+/**
+ * Unlinks a block from its free list in O(1).
+ */
+void removeFree(Block* block) {
+  size_t index = sizeClass(getSize(block));
+  Block*& head = heap.lists[index];
+
+  if (prevFree(block) != nullptr) {
+    setNextFree(prevFree(block), nextFree(block));
+  } else {
+    head = nextFree(block);
+  }
+
+  if (nextFree(block) != nullptr) {
+    setPrevFree(nextFree(block), prevFree(block));
+  }
+
+  if (head == nullptr) {
+    heap.nonEmptyClasses &= ~(uint64_t(1) << index);
+  }
+}
+
+/**
+ * Segregated-fit algorithm (see the previous chapter).
+ */
+Block* findBlock(size_t alignedSize) {
+  size_t index = sizeClass(alignedSize);
+
+  if (index >= kExactClasses) {
+    for (Block* block = heap.lists[index]; block != nullptr; block = nextFree(block)) {
+      if (getSize(block) >= alignedSize) {
+        return block;
+      }
+    }
+
+    index++;
+  }
+
+  uint64_t candidates = index < 64 ? heap.nonEmptyClasses & (~uint64_t(0) << index) : 0;
+  if (candidates == 0) {
+    return nullptr;
+  }
+
+  return heap.lists[__builtin_ctzll(candidates)];
+}
+
+/**
+ * Merges a free block (not in a free list) with its free neighbours,
+ * returns the resulting block.
+ */
+Block* coalesce(Block* block) {
+  Block* next = physicalNext(block);
+  if (!isUsed(next)) {
+    removeFree(next);
+    setSize(block, getSize(block) + allocSize(getSize(next)));
+  }
+
+  word_t prevFooter = ((word_t*)block)[-1];
+  if (!(prevFooter & kUsed)) {
+    Block* prev = (Block*)((char*)block - allocSize(prevFooter & ~kFlagsMask));
+    removeFree(prev);
+    setSize(prev, getSize(prev) + allocSize(getSize(block)));
+    block = prev;
+  }
+
+  setFooter(block);
+  return block;
+}
+
+/**
+ * Returns a block to the free lists. Caller holds `heap.lock`.
+ */
+void heapFree(Block* block) {
+  setUsed(block, false);
+  block = coalesce(block);
+  insertFree(block);
+}
+
+/**
+ * Turns the unused end of the current chunk into a free block,
+ * so it's not lost when the next chunk is mapped.
+ */
+void retireChunkTail() {
+  Chunk* chunk = heap.chunks;
+  size_t rest = chunk->end - chunk->bump;
+  if (rest < allocSize(kMinPayloadSize)) {
+    return;
+  }
+
+  // Takes over the epilogue.
+  Block* block = (Block*)chunk->bump;
+  block->sizeAndFlags = (rest - allocSize(0)) | kUsed;
+  chunk->bump = chunk->end;
+  ((Block*)chunk->bump)->sizeAndFlags = kUsed;
+
+  heapFree(block);
+}
+
+/**
+ * Maps a new chunk with room for at least `needed` bytes of blocks.
+ */
+bool mapChunk(size_t needed) {
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  size_t chunkSize = sizeof(Chunk) + 2 * sizeof(word_t) + needed;
+  chunkSize = (chunkSize + pageSize - 1) & ~(pageSize - 1);
+  if (chunkSize < heap.nextChunkSize) {
+    chunkSize = heap.nextChunkSize;
+  }
+
+  void* memory = mmap(nullptr, chunkSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+
+  if (heap.chunks != nullptr) {
+    retireChunkTail();
+  }
+
+  Chunk* chunk = (Chunk*)memory;
+  chunk->next = heap.chunks;
+  chunk->size = chunkSize;
+  chunk->end = (char*)memory + chunkSize - sizeof(word_t);
+
+  word_t* fencepost = (word_t*)(chunk + 1);
+  *fencepost = kFencepost;
+  chunk->bump = (char*)(fencepost + 1);
+  ((Block*)chunk->bump)->sizeAndFlags = kUsed;
+
+  heap.chunks = chunk;
+
+  if (heap.nextChunkSize < kMaxChunkSize) {
+    heap.nextChunkSize *= 2;
+  }
+
+  return true;
+}
+
+/**
+ * Bump-allocates a fresh used block, mapping a new chunk when needed.
+ */
+Block* bumpBlock(size_t size) {
+  size_t needed = allocSize(size);
+
+  // OOM. (Out Of Memory)
+  if (heap.chunks == nullptr || heap.chunks->bump + needed > heap.chunks->end) {
+    if (!mapChunk(needed)) {
+      return nullptr;
+    }
+  }
+
+  // Takes over the epilogue.
+  Block* block = (Block*)heap.chunks->bump;
+  block->sizeAndFlags = size | kUsed;
+  setFooter(block);
+
+  heap.chunks->bump += needed;
+  ((Block*)heap.chunks->bump)->sizeAndFlags = kUsed;
+
+  return block;
+}
+
+/**
+ * Smallest payload left over by a split.
+ */
+static constexpr size_t kMinSplitRemainder = kMinPayloadSize;
+
+/**
+ * Allocates a block from the free lists, splitting if needed,
+ * or from the chunk. Caller holds `heap.lock`.
+ */
+Block* heapAlloc(size_t alignedSize) {
+  Block* block = findBlock(alignedSize);
+  if (block == nullptr) {
+    return bumpBlock(alignedSize);
+  }
+
+  removeFree(block);
+
+  if (getSize(block) >= allocSize(alignedSize) + kMinSplitRemainder) {
+    Block* freePart = (Block*)((char*)block + allocSize(alignedSize));
+    freePart->sizeAndFlags = getSize(block) - allocSize(alignedSize);
+    setFooter(freePart);
+    insertFree(freePart);
+
+    setSize(block, alignedSize);
+  }
+
+  setUsed(block, true);
+  setFooter(block);
+
+  return block;
+}
+
+/**
+ * Validates the heap: block sizes add up to each chunk, every footer
+ * matches its header, no two free blocks are adjacent, and the free
+ * lists hold exactly the free blocks.
+ */
+bool checkHeap() {
+  std::lock_guard<std::mutex> guard(heap.lock);
+
+  size_t freeBlocks = 0;
+  for (Chunk* chunk = heap.chunks; chunk != nullptr; chunk = chunk->next) {
+    bool prevUsed = true;
+    char* cursor = (char*)(chunk + 1) + sizeof(word_t);
+
+    while (cursor < chunk->bump) {
+      Block* block = (Block*)cursor;
+
+      if (*getFooter(block) != (word_t)block->sizeAndFlags) {
+        return false;
+      }
+      if (!isUsed(block)) {
+        if (!prevUsed) {
+          return false;
+        }
+        freeBlocks++;
+      }
+
+      prevUsed = isUsed(block);
+      cursor += allocSize(getSize(block));
+    }
+
+    if (cursor != chunk->bump) {
+      return false;
+    }
+  }
+
+  for (Block* list : heap.lists) {
+    for (Block* block = list; block != nullptr; block = nextFree(block)) {
+      if (isUsed(block)) {
+        return false;
+      }
+      freeBlocks--;
+    }
+  }
+
+  return freeBlocks == 0;
+}
+
+// ---------------------------------------------------------
+// Central free lists
+
+/**
+ * Sizes cached per thread: 16, 24, ..., 128 bytes.
+ */
+static constexpr size_t kCacheClasses = kExactClasses - 1;
+static constexpr size_t kMaxCachedSize = kMaxExactSize;
+
+inline size_t cacheClass(size_t size) {
+  return size / sizeof(word_t) - 2;
+}
+
+inline size_t cacheClassSize(size_t index) {
+  return (index + 2) * sizeof(word_t);
+}
+
+/**
+ * Blocks move between the thread caches and the central heap
+ * in batches of this size.
+ */
+static constexpr size_t kBatchSize = 32;
+
+/**
+ * A thread cache flushes a batch when a class holds more than this.
+ */
+static constexpr size_t kMaxCachedBlocks = 2 * kBatchSize;
+
+/**
+ * A central list returns blocks to the heap when it holds more than this.
+ */
+static constexpr size_t kMaxCentralBlocks = 32 * kBatchSize;
+
+/**
+ * Ready-to-use blocks of one cache class, shared by all threads.
+ * Each class has its own lock, so threads refilling different classes
+ * don't contend, and the heap lock is only taken to carve new blocks
+ * or to give surplus ones back. Blocks stay used from the heap's point
+ * of view, and are linked through their first data word.
+ */
+struct CentralList
+{
+    std::mutex lock;
+    Block* head;
+    size_t count;
+};
+
+static CentralList centralLists[kCacheClasses];
+
+/**
+ * Takes a batch of blocks of a class for the `owner` cache: from its
+ * central list, or carved from the heap under a single lock. Returns
+ * the number of blocks linked from `first`.
+ */
+size_t fetchBatch(size_t index, Block*& first, ThreadCache* owner) {
+  CentralList& central = centralLists[index];
+  size_t count = 0;
+  first = nullptr;
+
+  {
+    std::lock_guard<std::mutex> guard(central.lock);
+    while (count < kBatchSize && central.head != nullptr) {
+      Block* block = central.head;
+      central.head = nextFree(block);
+      central.count--;
+
+      block->owner = owner;
+      setNextFree(block, first);
+      first = block;
+      count++;
+    }
+  }
+
+  if (count == 0) {
+    std::lock_guard<std::mutex> guard(heap.lock);
+    while (count < kBatchSize) {
+      Block* block = heapAlloc(cacheClassSize(index));
+      if (block == nullptr) {
+        break;
+      }
+
+      block->owner = owner;
+      setNextFree(block, first);
+      first = block;
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Gives `count` linked blocks of a class back to its central list.
+ * Past `kMaxCentralBlocks` the surplus goes back to the heap, so the
+ * memory can be coalesced and reused for other sizes.
+ */
+void releaseBatch(size_t index, Block* first, size_t count) {
+  CentralList& central = centralLists[index];
+  Block* surplus = nullptr;
+
+  {
+    std::lock_guard<std::mutex> guard(central.lock);
+    while (first != nullptr) {
+      Block* block = first;
+      first = nextFree(block);
+
+      setNextFree(block, central.head);
+      central.head = block;
+    }
+    central.count += count;
+
+    while (central.count > kMaxCentralBlocks) {
+      Block* block = central.head;
+      central.head = nextFree(block);
+      central.count--;
+
+      setNextFree(block, surplus);
+      surplus = block;
+    }
+  }
+
+  if (surplus != nullptr) {
+    std::lock_guard<std::mutex> guard(heap.lock);
+    while (surplus != nullptr) {
+      Block* block = surplus;
+      surplus = nextFree(block);
+      heapFree(block);
+    }
+  }
+}
+
+// ---------------------------------------------------------
+// Thread caches
+
+/**
+ * Free blocks of the small classes owned by one thread. Only its
+ * thread touches the bins, so the fast paths need no lock. Blocks
+ * freed by other threads are pushed to `remoteFrees` instead, and
+ * the owner takes them over on its next refill.
+ */
+struct ThreadCache
+{
+    /**
+     * Singly-linked cached blocks per class, and their number.
+     */
+    Block* bins[kCacheClasses];
+    size_t counts[kCacheClasses];
+
+    /**
+     * Lock-free stack of blocks freed by other threads: many threads
+     * push, only the owner takes the whole stack at once.
+     */
+    std::atomic<Block*> remoteFrees;
+
+    /**
+     * All caches ever created, and whether the thread is gone.
+     */
+    ThreadCache* nextCache;
+    bool abandoned;
+};
+
+/**
+ * Caches are never destroyed: other threads may still hold blocks
+ * of a finished thread and push them back. A new thread adopts an
+ * abandoned cache (with whatever was pushed to it meanwhile).
+ */
+static std::mutex cachesLock;
+static ThreadCache* caches;
+
+ThreadCache* acquireCache() {
+  std::lock_guard<std::mutex> guard(cachesLock);
+
+  for (ThreadCache* cache = caches; cache != nullptr; cache = cache->nextCache) {
+    if (cache->abandoned) {
+      cache->abandoned = false;
+      return cache;
+    }
+  }
+
+  ThreadCache* cache = new ThreadCache();
+  cache->nextCache = caches;
+  caches = cache;
+
+  return cache;
+}
+
+/**
+ * Flushes one batch of a class, when the thread frees much more
+ * than it allocates.
+ */
+void flushBatch(ThreadCache& cache, size_t index) {
+  Block* first = cache.bins[index];
+  Block* last = first;
+  for (size_t i = 1; i < kBatchSize; i++) {
+    last = nextFree(last);
+  }
+
+  cache.bins[index] = nextFree(last);
+  cache.counts[index] -= kBatchSize;
+  setNextFree(last, nullptr);
+
+  releaseBatch(index, first, kBatchSize);
+}
+
+/**
+ * Puts a freed block to the bin of the class it fits. A block carved
+ * for a class may be a bit bigger than the class size (no split).
+ */
+void cachePush(ThreadCache& cache, Block* block) {
+  size_t index = cacheClass(getSize(block));
+
+  setNextFree(block, cache.bins[index]);
+  cache.bins[index] = block;
+  cache.counts[index]++;
+
+  if (cache.counts[index] > kMaxCachedBlocks) {
+    flushBatch(cache, index);
+  }
+}
+
+/**
+ * Pushes a block freed by a foreign thread to its owner: one CAS.
+ * The stack is only ever emptied as a whole, so there is no ABA.
+ */
+void remoteFree(ThreadCache* owner, Block* block) {
+  Block* head = owner->remoteFrees.load(std::memory_order_relaxed);
+  do {
+    setNextFree(block, head);
+  } while (!owner->remoteFrees.compare_exchange_weak(
+      head, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+/**
+ * Moves the blocks freed by other threads into the bins.
+ * Returns whether there were any.
+ */
+bool drainRemoteFrees(ThreadCache& cache) {
+  if (cache.remoteFrees.load(std::memory_order_relaxed) == nullptr) {
+    return false;
+  }
+
+  Block* block = cache.remoteFrees.exchange(nullptr, std::memory_order_acquire);
+  while (block != nullptr) {
+    Block* next = nextFree(block);
+    cachePush(cache, block);
+    block = next;
+  }
+
+  return true;
+}
+
+/**
+ * A finished thread gives all its blocks back, and leaves the
+ * cache for adoption.
+ */
+void releaseCache(ThreadCache& cache) {
+  drainRemoteFrees(cache);
+
+  for (size_t index = 0; index < kCacheClasses; index++) {
+    if (cache.bins[index] != nullptr) {
+      releaseBatch(index, cache.bins[index], cache.counts[index]);
+      cache.bins[index] = nullptr;
+      cache.counts[index] = 0;
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(cachesLock);
+  cache.abandoned = true;
+}
+
+/**
+ * The cache of the current thread, acquired on first use.
+ */
+struct CacheHandle
+{
+    ThreadCache* cache;
+
+    ~CacheHandle() {
+      if (cache != nullptr) {
+        releaseCache(*cache);
+      }
+    }
+};
+
+static thread_local CacheHandle threadCache;
+
+inline ThreadCache& localCache() {
+  if (threadCache.cache == nullptr) {
+    threadCache.cache = acquireCache();
+  }
+  return *threadCache.cache;
+}
+
+/**
+ * Takes a block of a class from the cache. Refill: first take back
+ * what other threads freed, then go to the central list.
+ */
+Block* cachePop(ThreadCache& cache, size_t index) {
+  if (cache.bins[index] == nullptr) {
+    drainRemoteFrees(cache);
+  }
+
+  if (cache.bins[index] == nullptr) {
+    cache.counts[index] = fetchBatch(index, cache.bins[index], &cache);
+    if (cache.bins[index] == nullptr) {
+      return nullptr;
+    }
+  }
+
+  Block* block = cache.bins[index];
+  cache.bins[index] = nextFree(block);
+  cache.counts[index]--;
+
+  return block;
+}
+
+// ---------------------------------------------------------
+// Per-CPU arenas
+
+/**
+ * With thousands of mostly idle threads, per-thread caches keep
+ * thousands of batches around. In the arena mode the small classes
+ * are cached per CPU instead: the footprint scales with the cores,
+ * and threads running on the same CPU at once (only after a
+ * preemption) are rare, so the arena lock is almost never contended.
+ *
+ * An arena is a cache shared under a lock: it owns the blocks it hands
+ * out, and takes remote frees like a thread cache.
+ *
+ * Only the small classes (up to `kMaxCachedSize`) are per CPU, with
+ * each arena refilled in batches from the central lists, as thread
+ * caches are. Bigger blocks stay in the central heap, under its lock:
+ * they're split and coalesced with their neighbours, so they need one
+ * owner of the chunks. They're also much rarer, and their cost is
+ * dominated by the search and the memory they touch rather than the
+ * lock.
+ */
+struct Arena : ThreadCache
+{
+    std::mutex lock;
+};
+
+static constexpr size_t kMaxArenas = 64;
+
+static Arena arenas[kMaxArenas];
+
+/**
+ * Number of arenas in use, zero when the mode is off. It can be
+ * switched while other threads allocate, so each call reads it once.
+ */
+static std::atomic<size_t> arenaCount{0};
+
+/**
+ * Switches the small classes to per-CPU arenas (one per hardware
+ * thread), or back to per-thread caches. Blocks cached on either
+ * side stay valid: each one goes back to its owner.
+ */
+void enableCpuArenas(bool enable) {
+  size_t cpus = std::thread::hardware_concurrency();
+  if (cpus == 0) {
+    cpus = 1;
+  }
+
+  arenaCount.store(enable ? (cpus < kMaxArenas ? cpus : kMaxArenas) : 0,
+                   std::memory_order_relaxed);
+}
+
+/**
+ * Arena of the CPU the thread runs on. On recent glibc `sched_getcpu`
+ * reads the restartable sequences area, so it's a plain load. If the
+ * CPU is unknown, the thread id is hashed instead. A migration right
+ * after the lookup is harmless: the arena is locked anyway.
+ */
+Arena& currentArena(size_t count) {
+  int cpu = sched_getcpu();
+  size_t index = cpu >= 0 ? cpu : std::hash<std::thread::id>()(std::this_thread::get_id());
+
+  return arenas[index % count];
+}
+
+/**
+ * Mimicking the malloc function, we have the following
+ * interface (except we’re using typed word_t* instead
+ * of void* for the return type):
+ */
+
+/**
+ * Allocates a block of memory of (at least) `size` bytes.
+ * Safe to call from any thread.
+ */
+word_t* alloc(size_t size)
+{
+  size_t alignedSize = align(size);
+  if (alignedSize < kMinPayloadSize)
+  {
+    alignedSize = kMinPayloadSize;
+  }
+
+  size_t count = arenaCount.load(std::memory_order_relaxed);
+
+  // ---------------------------------------------------------
+  // 1. Small sizes come from the thread cache, without a lock:
+
+  if (alignedSize <= kMaxCachedSize && count == 0)
+  {
+    Block* block = cachePop(localCache(), cacheClass(alignedSize));
+
+    return block != nullptr ? block->data : nullptr;
+  }
+
+  // ---------------------------------------------------------
+  // 2. Or from the arena of the current CPU, under its lock:
+
+  if (alignedSize <= kMaxCachedSize)
+  {
+    Arena& arena = currentArena(count);
+    std::lock_guard<std::mutex> guard(arena.lock);
+    Block* block = cachePop(arena, cacheClass(alignedSize));
+
+    return block != nullptr ? block->data : nullptr;
+  }
+
+  // ---------------------------------------------------------
+  // 3. Bigger ones from the central heap:
+
+  std::lock_guard<std::mutex> guard(heap.lock);
+  Block* block = heapAlloc(alignedSize);
+
+  return block != nullptr ? block->data : nullptr;
+}
+
+/**
+ * Frees a previously allocated block. Safe to call from any thread.
+ */
+void free(word_t* data)
+{
+  Block* block = getHeader(data);
+
+  if (getSize(block) <= kMaxCachedSize)
+  {
+    size_t count = arenaCount.load(std::memory_order_relaxed);
+    ThreadCache* cache = count == 0 ? &localCache() : &currentArena(count);
+
+    // A foreign block goes back to its owner, without a lock.
+    if (block->owner != cache)
+    {
+      remoteFree(block->owner, block);
+      return;
+    }
+
+    if (count == 0)
+    {
+      cachePush(*cache, block);
+      return;
+    }
+
+    std::lock_guard<std::mutex> guard(static_cast<Arena*>(cache)->lock);
+    cachePush(*cache, block);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(heap.lock);
+  heapFree(block);
+}
+
+#define USE_THREAD_CACHE
+#define USE_THREADS
+#define USE_REMOTE_FREE
+#define USE_CPU_ARENAS
+
+int main()
+{
+#ifdef USE_THREAD_CACHE
+  {
+    // --------------------------------------
+    // Test case 1: Thread cache
+    //
+    // The first allocation of a class refills a whole batch,
+    // the next ones are served from the cache.
+    //
+    auto p1 = alloc(16);
+    size_t index = cacheClass(16);
+    assert(localCache().counts[index] == kBatchSize - 1);
+
+    auto p2 = alloc(10);
+    assert(localCache().counts[index] == kBatchSize - 2);
+    assert(getSize(getHeader(p1)) == 16 && getSize(getHeader(p2)) == 16);
+
+    // Freed blocks go back to the cache (LIFO), still used for the heap:
+    free(p1);
+    assert(localCache().bins[index] == getHeader(p1));
+    assert(isUsed(getHeader(p1)));
+    assert(alloc(16) == p1);
+
+    // Big sizes go to the heap directly:
+    auto p3 = alloc(1000);
+    assert(getSize(getHeader(p3)) == 1000);
+    free(p3);
+    assert(!isUsed(getHeader(p3)));
+
+    // Freeing a lot flushes batches to the central list:
+    word_t* objects[3 * kBatchSize];
+    for (auto& object : objects) {
+      object = alloc(64);
+    }
+    for (auto object : objects) {
+      free(object);
+    }
+    assert(localCache().counts[cacheClass(64)] <= kMaxCachedBlocks);
+    assert(centralLists[cacheClass(64)].count >= kBatchSize);
+
+    assert(checkHeap());
+  }
+#endif
+
+#ifdef USE_THREADS
+  {
+    // --------------------------------------
+    // Test case 2: Many threads
+    //
+    // Each thread fills its blocks with its own pattern and checks it
+    // before freeing: a block handed out twice would be overwritten.
+    //
+    const size_t threads = 8;
+    std::vector<std::thread> workers;
+
+    for (size_t t = 0; t < threads; t++) {
+      workers.emplace_back([t]() {
+        unsigned seed = t;
+        word_t* live[256] = {};
+        size_t sizes[256] = {};
+
+        for (int round = 0; round < 200000; round++) {
+          size_t i = rand_r(&seed) % 256;
+
+          if (live[i] != nullptr) {
+            for (size_t w = 0; w < sizes[i] / sizeof(word_t); w++) {
+              assert(live[i][w] == (word_t)(t * 1000 + i));
+            }
+            free(live[i]);
+            live[i] = nullptr;
+            continue;
+          }
+
+          // Mostly small, sometimes bigger than the cached sizes.
+          sizes[i] = rand_r(&seed) % 8 == 0 ? 1 + rand_r(&seed) % 2048 : 1 + rand_r(&seed) % 128;
+          live[i] = alloc(sizes[i]);
+          for (size_t w = 0; w < sizes[i] / sizeof(word_t); w++) {
+            live[i][w] = t * 1000 + i;
+          }
+        }
+
+        for (auto object : live) {
+          if (object != nullptr) {
+            free(object);
+          }
+        }
+      });
+    }
+
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    // Finished threads gave their caches back.
+    size_t central = 0;
+    for (auto& list : centralLists) {
+      central += list.count;
+      assert(list.count <= kMaxCentralBlocks);
+    }
+    assert(central > 0);
+
+    assert(checkHeap());
+  }
+#endif
+
+#ifdef USE_REMOTE_FREE
+  {
+    // --------------------------------------
+    // Test case 3: Remote frees
+    //
+    // A block freed by another thread is pushed to its owner,
+    // and taken back when the owner runs out of the class.
+    //
+    auto p1 = alloc(48);
+    ThreadCache& cache = localCache();
+    size_t index = cacheClass(48);
+    size_t cached = cache.counts[index];
+
+    std::thread([p1]() { free(p1); }).join();
+    assert(cache.remoteFrees.load() == getHeader(p1));
+    assert(cache.counts[index] == cached);
+
+    for (size_t i = 0; i < cached; i++) {
+      alloc(48);
+    }
+    assert(alloc(48) == p1);
+    assert(cache.remoteFrees.load() == nullptr);
+
+    // A finished thread leaves its cache, which still takes remote frees:
+    ThreadCache* finished = nullptr;
+    word_t* p2 = nullptr;
+    std::thread([&]() {
+      p2 = alloc(48);
+      finished = &localCache();
+    }).join();
+
+    assert(finished->abandoned);
+    free(p2);
+    assert(finished->remoteFrees.load() == getHeader(p2));
+
+    // Producer/consumer: one thread allocates the messages, the other
+    // frees them. The producer keeps reusing the freed blocks, so the
+    // heap doesn't grow.
+    size_t chunks = 0;
+    for (Chunk* chunk = heap.chunks; chunk != nullptr; chunk = chunk->next) {
+      chunks++;
+    }
+
+    const size_t messages = 1000000;
+    const size_t capacity = 1024;
+    static word_t* queue[capacity];
+    std::atomic<size_t> head{0}, tail{0};
+
+    std::thread producer([&]() {
+      for (size_t i = 0; i < messages; i++) {
+        word_t* message = alloc(32);
+        message[0] = i;
+        while (tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire) == capacity) {
+          std::this_thread::yield();
+        }
+        queue[tail.load(std::memory_order_relaxed) % capacity] = message;
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
+    });
+
+    std::thread consumer([&]() {
+      for (size_t i = 0; i < messages; i++) {
+        while (head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire)) {
+          std::this_thread::yield();
+        }
+        word_t* message = queue[head.load(std::memory_order_relaxed) % capacity];
+        assert(message[0] == (word_t)i);
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        free(message);
+      }
+    });
+
+    producer.join();
+    consumer.join();
+
+    size_t chunksAfter = 0;
+    for (Chunk* chunk = heap.chunks; chunk != nullptr; chunk = chunk->next) {
+      chunksAfter++;
+    }
+    assert(chunksAfter == chunks);
+
+    assert(checkHeap());
+  }
+#endif
+
+#ifdef USE_CPU_ARENAS
+  {
+    // --------------------------------------
+    // Test case 4: Per-CPU arenas
+    //
+    // Many short threads allocate in the arena mode without
+    // creating thread caches.
+    //
+    auto p1 = alloc(24);
+    enableCpuArenas(true);
+
+    auto p2 = alloc(24);
+    ThreadCache* owner = getHeader(p2)->owner;
+    assert(owner >= arenas && owner < arenas + arenaCount);
+    free(p2);
+
+    // A block of a thread cache freed in the arena mode goes back to it:
+    free(p1);
+    assert(localCache().remoteFrees.load() == getHeader(p1));
+
+    size_t cachesBefore = 0;
+    for (ThreadCache* cache = caches; cache != nullptr; cache = cache->nextCache) {
+      cachesBefore++;
+    }
+
+    const size_t threads = 64;
+    std::vector<std::thread> workers;
+
+    for (size_t t = 0; t < threads; t++) {
+      workers.emplace_back([t]() {
+        word_t* live[64];
+        for (int round = 0; round < 1000; round++) {
+          for (size_t i = 0; i < 64; i++) {
+            live[i] = alloc(8 + (i % 16) * 8);
+            live[i][0] = t;
+          }
+          for (size_t i = 0; i < 64; i++) {
+            assert(live[i][0] == (word_t)t);
+            free(live[i]);
+          }
+        }
+      });
+    }
+
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    size_t cachesAfter = 0;
+    for (ThreadCache* cache = caches; cache != nullptr; cache = cache->nextCache) {
+      cachesAfter++;
+    }
+    assert(cachesAfter == cachesBefore);
+
+    // Arenas cache at most a few batches per class each:
+    for (size_t i = 0; i < arenaCount; i++) {
+      for (size_t index = 0; index < kCacheClasses; index++) {
+        assert(arenas[i].counts[index] <= kMaxCachedBlocks);
+      }
+    }
+
+    // The mode can be switched while other threads allocate:
+    // each block still goes back to its owner.
+    std::atomic<bool> stop{false};
+    workers.clear();
+    for (size_t t = 0; t < 4; t++) {
+      workers.emplace_back([t, &stop]() {
+        word_t* live[64];
+        while (!stop.load()) {
+          for (size_t i = 0; i < 64; i++) {
+            live[i] = alloc(8 + (i % 16) * 8);
+            live[i][0] = t;
+          }
+          for (size_t i = 0; i < 64; i++) {
+            assert(live[i][0] == (word_t)t);
+            free(live[i]);
+          }
+        }
+      });
+    }
+
+    for (int round = 0; round < 100; round++) {
+      enableCpuArenas(round % 2 == 0);
+      std::this_thread::yield();
+    }
+    stop.store(true);
+
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    enableCpuArenas(false);
+    assert(checkHeap());
+  }
+#endif
+
+  puts("\nAll assertions passed!\n");
+  return 0;
+}
@@ -0,0 +1,2328 @@
+// Writing a Memory Allocator by Dmitry Soshnikov
+// Mark-sweep collector.
+// The previous chapters only reclaim memory on an explicit free.
+// Here objects are reclaimed automatically: starting from a set of
+// registered roots, the collector marks every reachable block, and
+// then sweeps the heap, returning unmarked blocks to the free lists.
+// The marks live in side bitmaps of the heap chunks, next to bitmaps
+// of the block starts: the sweep scans them a word at a time.
+// Optionally, the marking is incremental: done in small slices on
+// allocations, with a write barrier keeping the mutator honest, or
+// concurrent: done by a background thread while the mutator runs.
+// A full collection can also mark in parallel, on several threads.
+// The sweep can be lazy: done chunk by chunk by the allocations,
+// parallel, or concurrent: done by a background thread.
+// http://dmitrysoshnikov.com/compilers/writing-a-memory-allocator/
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <stdint.h>
+#include <unistd.h> // for sysconf
+#include <sys/mman.h> // for mmap
+#include <utility> // for std::declval
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+
+/**
+ * Machine word size. Depending on the architecture,
+ * can be 4 or 8 bytes.
+ */
+using word_t = intptr_t;
+
+/**
+ * Allocated block of memory. Contains the object header structure,
+ * and the actual payload pointer.
+ */
+struct Block
+{
+
+    // -------------------------------------
+    // 1. Object header
+
+    /**
+     * Block size. Sizes are aligned by the machine word, so the
+     * low bits are always zero and keep the block flags instead.
+     */
+    size_t sizeAndFlags; // 8bytes
+
+    // -------------------------------------
+    // 2. User data
+
+    /**
+     * Payload pointer.
+     */
+    word_t data[1]; // 8bytes
+};
+
+/**
+ * Block flags, stored in the low bits of `Block::sizeAndFlags`.
+ */
+static constexpr size_t kUsed = 1; // the block is allocated
+static constexpr size_t kFlagsMask = kUsed;
+
+inline size_t getSize(Block* block) {
+  return block->sizeAndFlags & ~kFlagsMask;
+}
+
+inline void setSize(Block* block, size_t size) {
+  block->sizeAndFlags = size | (block->sizeAndFlags & kFlagsMask);
+}
+
+inline void setFlag(Block* block, size_t flag, bool value) {
+  block->sizeAndFlags = value ? block->sizeAndFlags | flag : block->sizeAndFlags & ~flag;
+}
+
+inline bool isUsed(Block* block) {
+  return block->sizeAndFlags & kUsed;
+}
+
+inline void setUsed(Block* block, bool used) {
+  setFlag(block, kUsed, used);
+}
+
+/**
+ * Aligns the size by the machine word.
+ */
+inline size_t align(size_t n)
+{
+    return (n + sizeof(word_t) - 1) & ~(sizeof(word_t) - 1);
+}
+
+/**
+ * Minimum payload size: a free block stores two free-list links in it.
+ */
+static constexpr size_t kMinPayloadSize = 2 * sizeof(word_t);
+
+/**
+ * Object header size, without the first data word.
+ */
+static constexpr size_t kHeaderSize = sizeof(Block) - sizeof(std::declval<Block>().data);
+
+/**
+ * Returns total allocation size, reserving in addition the space for
+ * the Block structure (object header + first data word).
+ *
+ * Since the `word_t data[1]` already allocates one word inside the Block
+ * structure, we decrease it from the size request: if a user allocates
+ * only one word, it's fully in the Block struct.
+ */
+inline size_t allocSize(size_t size) {
+  return size + kHeaderSize;
+}
+
+/**
+ * Returns the object header.
+ */
+Block* getHeader(word_t* data) {
+  return (Block*)((char*)data - kHeaderSize);
+}
+
+// ---------------------------------------------------------
+// Values
+
+/**
+ * The collector needs to tell references from other data in the
+ * payloads. As in many dynamic language runtimes, every payload word
+ * is a value: a word with the low bit set is an immediate (a tagged
+ * integer), zero is null, and anything else is a pointer to the
+ * payload of another block.
+ */
+inline bool isPointer(word_t value) {
+  return value != 0 && (value & 1) == 0;
+}
+
+inline word_t tagInt(intptr_t n) {
+  return (word_t)(((uintptr_t)n << 1) | 1);
+}
+
+inline intptr_t untagInt(word_t value) {
+  return value >> 1;
+}
+
+// ---------------------------------------------------------
+// Free lists
+
+/**
+ * Free blocks don't use their payload, so the free-list links
+ * are stored in the first two data words instead of growing the header.
+ * (Accessed with memcpy: the payload is declared as words.)
+ */
+inline Block* nextFree(Block* block) {
+  Block* next;
+  memcpy(&next, &block->data[0], sizeof(next));
+  return next;
+}
+
+inline Block* prevFree(Block* block) {
+  Block* prev;
+  memcpy(&prev, (char*)block->data + sizeof(Block*), sizeof(prev));
+  return prev;
+}
+
+inline void setNextFree(Block* block, Block* next) {
+  memcpy(&block->data[0], &next, sizeof(next));
+}
+
+inline void setPrevFree(Block* block, Block* prev) {
+  memcpy((char*)block->data + sizeof(Block*), &prev, sizeof(prev));
+}
+
+/**
+ * Number of exact size classes: 8, 16, 24, ..., 128 bytes.
+ */
+static constexpr size_t kExactClasses = 16;
+
+/**
+ * Largest size served by an exact class.
+ */
+static constexpr size_t kMaxExactSize = kExactClasses * sizeof(word_t);
+
+/**
+ * Number of power-of-two classes above the exact ones:
+ * (128, 256], (256, 512], ... The last one also takes everything bigger.
+ */
+static constexpr size_t kPowerOfTwoClasses = 24;
+
+/**
+ * Total number of size classes.
+ */
+static constexpr size_t kSizeClasses = kExactClasses + kPowerOfTwoClasses;
+
+/**
+ * Free lists per size class, and the mask of the non-empty ones.
+ */
+static Block* freeLists[kSizeClasses];
+static uint64_t nonEmptyClasses = 0;
+
+/**
+ * Returns the size class of an aligned size.
+ */
+inline size_t sizeClass(size_t alignedSize) {
+  if (alignedSize <= kMaxExactSize) {
+    return alignedSize / sizeof(word_t) - 1;
+  }
+
+  size_t bits = 64 - __builtin_clzll(alignedSize - 1);
+  size_t index = kExactClasses + bits - 8;
+
+  return index < kSizeClasses ? index : kSizeClasses - 1;
+}
+
+/**
+ * Pushes a free block to the list of its size class.
+ */
+void insertFree(Block* block) {
+  size_t index = sizeClass(getSize(block));
+  Block*& head = freeLists[index];
+
+  setPrevFree(block, nullptr);
+  setNextFree(block, head);
+  if (head != nullptr) {
+    setPrevFree(head, block);
+  }
+  head = block;
+
+  nonEmptyClasses |= uint64_t(1) << index;
+}
+
+/**
+ * Unlinks a block from its free list in O(1).
+ */
+void removeFree(Block* block) {
+  size_t index = sizeClass(getSize(block));
+  Block*& head = freeLists[index];
+
+  if (prevFree(block) != nullptr) {
+    setNextFree(prevFree(block), nextFree(block));
+  } else {
+    head = nextFree(block);
+  }
+
+  if (nextFree(block) != nullptr) {
+    setPrevFree(nextFree(block), prevFree(block));
+  }
+
+  if (head == nullptr) {
+    nonEmptyClasses &= ~(uint64_t(1) << index);
+  }
+}
+
+/**
+ * Segregated-fit algorithm (see chapter 03).
+ */
+Block* findBlock(size_t size) {
+  size_t index = sizeClass(size);
+
+  if (index >= kExactClasses) {
+    for (Block* block = freeLists[index]; block != nullptr; block = nextFree(block)) {
+      if (getSize(block) >= size) {
+        return block;
+      }
+    }
+
+    index++;
+  }
+
+  uint64_t candidates = index < 64 ? nonEmptyClasses & (~uint64_t(0) << index) : 0;
+  if (candidates == 0) {
+    return nullptr;
+  }
+
+  return freeLists[__builtin_ctzll(candidates)];
+}
+
+// ---------------------------------------------------------
+// Chunks
+
+/**
+ * Chunks are mapped at `kChunkSize`-aligned addresses, so the chunk
+ * of a block is found by masking the block address.
+ */
+static constexpr size_t kChunkSize = size_t(256) << 10;
+
+/**
+ * Objects bigger than this get a chunk of their own.
+ */
+static constexpr size_t kLargeObjectThreshold = kChunkSize / 4;
+
+/**
+ * Region of memory mapped from the OS, blocks are bump-allocated in it.
+ */
+struct Chunk
+{
+    /**
+     * Previously mapped chunk.
+     */
+    Chunk* next;
+
+    /**
+     * Mapped size, including this header.
+     */
+    size_t size;
+
+    /**
+     * First unused byte, and the end of the chunk.
+     */
+    char* bump;
+    char* end;
+
+    /**
+     * A large chunk holds a single block, and its mark is kept
+     * here instead of in the bitmaps.
+     */
+    bool large;
+    bool largeMarked;
+};
+
+/**
+ * Bitmap words per chunk: one bit per word granule.
+ */
+static constexpr size_t kBitmapWords = kChunkSize / sizeof(word_t) / 64;
+
+/**
+ * Side tables of a small chunk, right after its header: one bit per
+ * granule for the block starts, and one for the marks. Marking only
+ * writes here, so it doesn't dirty the cache lines of live objects
+ * (nor their copy-on-write pages after a fork), and the sweep scans
+ * 64 granules per bitmap word.
+ */
+struct ChunkBitmaps
+{
+    uint64_t starts[kBitmapWords];
+    uint64_t marks[kBitmapWords];
+};
+
+inline ChunkBitmaps* bitmaps(Chunk* chunk) {
+  return (ChunkBitmaps*)(chunk + 1);
+}
+
+inline char* blocksStart(Chunk* chunk) {
+  return chunk->large ? (char*)(chunk + 1) : (char*)(bitmaps(chunk) + 1);
+}
+
+inline Chunk* chunkOf(void* address) {
+  return (Chunk*)((uintptr_t)address & ~(kChunkSize - 1));
+}
+
+/**
+ * Index of the granule of an address in its chunk, and back.
+ */
+inline size_t granule(Chunk* chunk, void* address) {
+  return ((char*)address - (char*)chunk) / sizeof(word_t);
+}
+
+inline char* granuleAddress(Chunk* chunk, size_t index) {
+  return (char*)chunk + index * sizeof(word_t);
+}
+
+inline bool testBit(uint64_t* bits, size_t index) {
+  return bits[index / 64] & (uint64_t(1) << (index % 64));
+}
+
+inline void setBit(uint64_t* bits, size_t index) {
+  bits[index / 64] |= uint64_t(1) << (index % 64);
+}
+
+/**
+ * Clears the bits [from, to), a word at a time.
+ */
+void clearBits(uint64_t* bits, size_t from, size_t to) {
+  while (from < to) {
+    size_t bit = from % 64;
+    size_t count = std::min<size_t>(64 - bit, to - from);
+    uint64_t mask = count == 64 ? ~uint64_t(0) : ((uint64_t(1) << count) - 1) << bit;
+
+    bits[from / 64] &= ~mask;
+    from += count;
+  }
+}
+
+inline void setBlockStart(Block* block) {
+  Chunk* chunk = chunkOf(block);
+  setBit(bitmaps(chunk)->starts, granule(chunk, block));
+}
+
+/**
+ * The marks may be set by a marking thread and by the mutator (which
+ * allocates black) at the same time, so they're set atomically.
+ */
+inline bool isMarked(Block* block) {
+  Chunk* chunk = chunkOf(block);
+  if (chunk->large) {
+    return __atomic_load_n(&chunk->largeMarked, __ATOMIC_RELAXED);
+  }
+
+  size_t index = granule(chunk, block);
+  uint64_t word = __atomic_load_n(&bitmaps(chunk)->marks[index / 64], __ATOMIC_RELAXED);
+  return word & (uint64_t(1) << (index % 64));
+}
+
+/**
+ * Sets the mark, returns whether it wasn't set before.
+ */
+inline bool tryMark(Block* block) {
+  Chunk* chunk = chunkOf(block);
+  if (chunk->large) {
+    return !__atomic_exchange_n(&chunk->largeMarked, true, __ATOMIC_RELAXED);
+  }
+
+  size_t index = granule(chunk, block);
+  uint64_t bit = uint64_t(1) << (index % 64);
+  return !(__atomic_fetch_or(&bitmaps(chunk)->marks[index / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+inline void setMarked(Block* block) {
+  tryMark(block);
+}
+
+/**
+ * All mapped chunks, and the small one blocks are bump-allocated from.
+ */
+static Chunk* chunks = nullptr;
+static Chunk* current = nullptr;
+
+/**
+ * Splits the block if the rest is big enough for a free block.
+ */
+void split(Block* block, size_t size) {
+  if (getSize(block) < allocSize(size) + kMinPayloadSize) {
+    return;
+  }
+
+  Block* freePart = (Block*)((char*)block + allocSize(size));
+  freePart->sizeAndFlags = getSize(block) - allocSize(size);
+  setBlockStart(freePart);
+  insertFree(freePart);
+
+  setSize(block, size);
+}
+
+/**
+ * Maps a chunk of `chunkSize` bytes at a `kChunkSize`-aligned address.
+ * Fresh anonymous memory is zeroed, so are the bitmaps.
+ */
+Chunk* mapChunk(size_t chunkSize) {
+  // Over-maps, and cuts the aligned part out of the mapping.
+  size_t mappedSize = chunkSize + kChunkSize;
+  void* memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  char* start = (char*)memory;
+  char* aligned = (char*)(((uintptr_t)start + kChunkSize - 1) & ~(kChunkSize - 1));
+  if (aligned > start) {
+    munmap(start, aligned - start);
+  }
+  munmap(aligned + chunkSize, start + mappedSize - (aligned + chunkSize));
+
+  Chunk* chunk = (Chunk*)aligned;
+  chunk->next = chunks;
+  chunk->size = chunkSize;
+  chunk->end = aligned + chunkSize;
+
+  chunks = chunk;
+  return chunk;
+}
+
+/**
+ * Makes [from, to) of a chunk one free block.
+ */
+Block* freeRange(Chunk* chunk, char* from, char* to) {
+  clearBits(bitmaps(chunk)->starts, granule(chunk, from), granule(chunk, to));
+
+  Block* block = (Block*)from;
+  block->sizeAndFlags = to - from - kHeaderSize;
+  setBlockStart(block);
+  return block;
+}
+
+/**
+ * Turns the unused end of the current chunk into a free block,
+ * so it's not lost when the next chunk is mapped.
+ */
+void retireChunkTail() {
+  if ((size_t)(current->end - current->bump) >= allocSize(kMinPayloadSize)) {
+    insertFree(freeRange(current, current->bump, current->end));
+  }
+  current->bump = current->end;
+}
+
+/**
+ * Allocates a block in a chunk of its own.
+ */
+Block* allocLarge(size_t size) {
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  size_t chunkSize = (sizeof(Chunk) + allocSize(size) + pageSize - 1) & ~(pageSize - 1);
+  Chunk* chunk = mapChunk(chunkSize);
+  if (chunk == nullptr) {
+    return nullptr;
+  }
+
+  chunk->large = true;
+  chunk->bump = chunk->end;
+
+  Block* block = (Block*)blocksStart(chunk);
+  block->sizeAndFlags = size;
+
+  return block;
+}
+
+/**
+ * Bump-allocates a new block from the current chunk,
+ * mapping a new one when needed.
+ */
+Block* requestFromOS(size_t size) {
+  size_t needed = allocSize(size);
+
+  // OOM. (Out Of Memory)
+  if (current == nullptr || current->bump + needed > current->end) {
+    Chunk* chunk = mapChunk(kChunkSize);
+    if (chunk == nullptr) {
+      return nullptr;
+    }
+
+    if (current != nullptr) {
+      retireChunkTail();
+    }
+
+    chunk->bump = blocksStart(chunk);
+    current = chunk;
+  }
+
+  Block* block = (Block*)current->bump;
+  current->bump += needed;
+
+  block->sizeAndFlags = size;
+  setBlockStart(block);
+
+  return block;
+}
+
+// ---------------------------------------------------------
+// Collector
+
+/**
+ * Root set: addresses of the slots (globals, locals of the host
+ * program) that hold values referring to the heap.
+ */
+static std::vector<word_t*> roots;
+
+void addRoot(word_t* slot) {
+  roots.push_back(slot);
+}
+
+void removeRoot(word_t* slot) {
+  auto root = std::find(roots.begin(), roots.end(), slot);
+  if (root != roots.end()) {
+    roots.erase(root);
+  }
+}
+
+/**
+ * Bytes allocated since the last collection, and how many
+ * trigger the next one.
+ */
+static size_t allocatedSinceGC = 0;
+static size_t gcThreshold = kChunkSize;
+
+/**
+ * Lower bound of the threshold. After each collection the threshold
+ * becomes the live size (so the heap at most doubles), but not less.
+ */
+static size_t minGcThreshold = kChunkSize;
+
+void setGcThreshold(size_t bytes) {
+  minGcThreshold = bytes;
+  gcThreshold = bytes;
+}
+
+/**
+ * Payload bytes of all used blocks.
+ */
+static size_t usedBytes = 0;
+
+/**
+ * Collector statistics.
+ */
+struct GCStats
+{
+    size_t collections;
+    size_t liveBytes;
+    size_t freedBytes;
+
+    /**
+     * Incremental marking slices, and the most words one scanned.
+     */
+    size_t slices;
+    size_t maxSliceWords;
+
+    /**
+     * Grey objects taken from another thread's deque by parallel marking.
+     */
+    size_t steals;
+
+    /**
+     * Chunks swept lazily, by allocations.
+     */
+    size_t lazySweeps;
+
+    /**
+     * Chunks swept by the sweeping thread.
+     */
+    size_t concurrentSweeps;
+};
+
+static GCStats gcStats;
+
+/**
+ * Grey objects: marked, but their payload isn't scanned yet. An explicit
+ * stack instead of recursion, so deep lists don't overflow the C stack.
+ */
+static std::vector<Block*> markStack;
+
+/**
+ * Marks the block a value refers to, if not yet marked.
+ */
+inline void markValue(word_t value) {
+  if (!isPointer(value)) {
+    return;
+  }
+
+  Block* block = getHeader((word_t*)value);
+  if (!isMarked(block) && tryMark(block)) {
+    markStack.push_back(block);
+  }
+}
+
+/**
+ * Scans grey objects until the stack is empty, or until `budget` payload
+ * words were scanned. An object is always scanned as a whole, so a slice
+ * may go over by one object. Returns the number of words scanned.
+ *
+ * The payload words are loaded atomically: with concurrent marking,
+ * the mutator may store into the object meanwhile (see `writeRef`).
+ */
+size_t drainMarkStack(size_t budget) {
+  size_t scanned = 0;
+
+  while (!markStack.empty() && scanned < budget) {
+    Block* block = markStack.back();
+    markStack.pop_back();
+
+    size_t words = getSize(block) / sizeof(word_t);
+    for (size_t i = 0; i < words; i++) {
+      markValue(__atomic_load_n(&block->data[i], __ATOMIC_RELAXED));
+    }
+    scanned += words;
+  }
+
+  return scanned;
+}
+
+/**
+ * Mark phase: everything reachable from the roots.
+ */
+void mark() {
+  for (word_t* slot : roots) {
+    markValue(*slot);
+  }
+
+  drainMarkStack(SIZE_MAX);
+}
+
+// ---------------------------------------------------------
+// Parallel marking
+
+/**
+ * Chase-Lev work-stealing deque of grey objects. Its owner pushes and
+ * takes at the bottom without contention; other threads steal from
+ * the top, competing with a CAS only for the last items. The circular
+ * array grows when full; the old ones are kept until the end of the
+ * marking, as thieves may still read them.
+ */
+class WorkDeque
+{
+  struct Array
+  {
+    explicit Array(int64_t capacity)
+        : capacity(capacity), items(new std::atomic<Block*>[capacity]) {}
+
+    Block* get(int64_t index) {
+      return items[index & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+
+    void put(int64_t index, Block* block) {
+      items[index & (capacity - 1)].store(block, std::memory_order_relaxed);
+    }
+
+    int64_t capacity;
+    std::unique_ptr<std::atomic<Block*>[]> items;
+  };
+
+ public:
+  WorkDeque() : array(new Array(1024)) {
+    arrays.emplace_back(array.load());
+  }
+
+  /**
+   * Owner only.
+   */
+  void push(Block* block) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Array* a = array.load(std::memory_order_relaxed);
+
+    if (b - t > a->capacity - 1) {
+      Array* bigger = new Array(2 * a->capacity);
+      for (int64_t i = t; i < b; i++) {
+        bigger->put(i, a->get(i));
+      }
+      arrays.emplace_back(bigger);
+      array.store(bigger, std::memory_order_release);
+      a = bigger;
+    }
+
+    a->put(b, block);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  /**
+   * Owner only. Returns nullptr when empty.
+   */
+  Block* take() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array* a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    Block* block = a->get(b);
+    if (t == b) {
+      // The last item: races with the thieves.
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        block = nullptr;
+      }
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    return block;
+  }
+
+  /**
+   * Any thread. Returns nullptr when empty, or when it lost a race.
+   */
+  Block* steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b) {
+      return nullptr;
+    }
+
+    Block* block = array.load(std::memory_order_acquire)->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return nullptr;
+    }
+
+    return block;
+  }
+
+  bool empty() const {
+    return bottom.load(std::memory_order_acquire) <= top.load(std::memory_order_acquire);
+  }
+
+ private:
+  std::atomic<int64_t> top{0};
+  std::atomic<int64_t> bottom{0};
+  std::atomic<Array*> array;
+  std::vector<std::unique_ptr<Array>> arrays;
+};
+
+/**
+ * Threads used by the mark phase of a full collection, the calling
+ * one included.
+ */
+static size_t markThreads = 1;
+
+void setMarkThreads(size_t threads) {
+  markThreads = threads > 0 ? threads : 1;
+}
+
+/**
+ * Deques of the current parallel marking, and the number of workers
+ * which found no work (for the termination).
+ */
+static std::vector<std::unique_ptr<WorkDeque>> deques;
+static std::atomic<size_t> idleWorkers{0};
+static std::atomic<size_t> steals{0};
+
+/**
+ * Tries to steal a grey object from the other deques.
+ */
+Block* stealWork(size_t id) {
+  for (size_t i = 1; i < deques.size(); i++) {
+    Block* block = deques[(id + i) % deques.size()]->steal();
+    if (block != nullptr) {
+      steals.fetch_add(1, std::memory_order_relaxed);
+      return block;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Termination: an idle worker waits until either all workers are idle
+ * (with empty deques, so no work can appear anymore), or some deque has
+ * work again. Returns whether the marking is over.
+ */
+bool terminate() {
+  idleWorkers.fetch_add(1, std::memory_order_acq_rel);
+
+  for (;;) {
+    if (idleWorkers.load(std::memory_order_acquire) == deques.size()) {
+      return true;
+    }
+
+    for (auto& deque : deques) {
+      if (!deque->empty()) {
+        idleWorkers.fetch_sub(1, std::memory_order_acq_rel);
+        return false;
+      }
+    }
+
+    std::this_thread::yield();
+  }
+}
+
+/**
+ * A marking worker: scans its own grey objects, then steals,
+ * until all workers run out of work. The atomic `tryMark` makes sure
+ * every object is pushed (and scanned) by one worker only.
+ */
+void markWorker(size_t id) {
+  WorkDeque& deque = *deques[id];
+
+  for (;;) {
+    Block* block;
+    while ((block = deque.take()) != nullptr || (block = stealWork(id)) != nullptr) {
+      size_t words = getSize(block) / sizeof(word_t);
+      for (size_t i = 0; i < words; i++) {
+        word_t value = __atomic_load_n(&block->data[i], __ATOMIC_RELAXED);
+        if (!isPointer(value)) {
+          continue;
+        }
+
+        Block* child = getHeader((word_t*)value);
+        if (!isMarked(child) && tryMark(child)) {
+          deque.push(child);
+        }
+      }
+    }
+
+    if (terminate()) {
+      return;
+    }
+  }
+}
+
+/**
+ * Parallel mark phase: the roots (and the grey objects of an interrupted
+ * incremental marking) are dealt to the deques, and the workers run.
+ */
+void parallelMark() {
+  deques.clear();
+  for (size_t i = 0; i < markThreads; i++) {
+    deques.emplace_back(new WorkDeque());
+  }
+  idleWorkers.store(0);
+  steals.store(0);
+
+  for (word_t* slot : roots) {
+    markValue(*slot);
+  }
+
+  for (size_t i = 0; i < markStack.size(); i++) {
+    deques[i % markThreads]->push(markStack[i]);
+  }
+  markStack.clear();
+
+  std::vector<std::thread> workers;
+  for (size_t id = 1; id < markThreads; id++) {
+    workers.emplace_back(markWorker, id);
+  }
+  markWorker(0);
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  gcStats.steals += steals.load();
+  deques.clear();
+}
+
+// ---------------------------------------------------------
+// Incremental marking
+
+/**
+ * Tri-color marking spread over many allocations: white objects are
+ * unmarked, grey ones are marked and in the mark stack, black ones are
+ * marked and scanned. While the mutator runs between the slices, it
+ * must never store a white object into a black one (and drop the
+ * other references to it): the write barrier shades the stored object
+ * grey (Dijkstra's insertion barrier), and new objects are allocated
+ * black.
+ */
+enum class GCPhase
+{
+    Idle,
+    Marking,
+    ConcurrentMarking,
+};
+
+static GCPhase gcPhase = GCPhase::Idle;
+
+/**
+ * Whether collections are incremental, and the payload words
+ * scanned by each slice, bounding its pause.
+ */
+static bool incremental = false;
+static size_t markBudget = 1024;
+
+void setIncremental(bool enable, size_t budget = 1024) {
+  incremental = enable;
+  markBudget = budget;
+}
+
+void logOverwritten(word_t value);
+
+/**
+ * Write barrier: every store of a value into a heap object goes
+ * through it while marking is in progress.
+ */
+inline void writeRef(word_t* object, size_t index, word_t value) {
+  if (gcPhase == GCPhase::ConcurrentMarking) {
+    logOverwritten(object[index]);
+  }
+
+  __atomic_store_n(&object[index], value, __ATOMIC_RELAXED);
+
+  if (gcPhase == GCPhase::Marking) {
+    markValue(value);
+  }
+}
+
+/**
+ * Starts a cycle: the roots are shaded grey.
+ */
+void startMarking() {
+  gcPhase = GCPhase::Marking;
+
+  for (word_t* slot : roots) {
+    markValue(*slot);
+  }
+}
+
+void finishCycle();
+
+/**
+ * One bounded slice of marking. When the grey objects run out, the
+ * roots are shaded again (stores into the roots aren't behind the
+ * barrier), and if that found nothing new, the cycle is finished.
+ * Returns whether it was.
+ */
+bool markSlice(size_t budget) {
+  size_t scanned = drainMarkStack(budget);
+
+  gcStats.slices++;
+  if (scanned > gcStats.maxSliceWords) {
+    gcStats.maxSliceWords = scanned;
+  }
+
+  if (!markStack.empty()) {
+    return false;
+  }
+
+  for (word_t* slot : roots) {
+    markValue(*slot);
+  }
+
+  if (!markStack.empty()) {
+    return false;
+  }
+
+  finishCycle();
+  return true;
+}
+
+/**
+ * Free blocks found by a sweep, in lists of their own (with the tails,
+ * to be spliced into the global ones in O(1)). This way chunks can be
+ * swept by other threads, which must not touch the global free lists.
+ */
+struct SweptBlocks
+{
+    Block* heads[kSizeClasses];
+    Block* tails[kSizeClasses];
+    size_t freedBytes;
+};
+
+void addSwept(SweptBlocks& swept, Block* block) {
+  size_t index = sizeClass(getSize(block));
+  Block*& head = swept.heads[index];
+
+  setPrevFree(block, nullptr);
+  setNextFree(block, head);
+  if (head != nullptr) {
+    setPrevFree(head, block);
+  } else {
+    swept.tails[index] = block;
+  }
+  head = block;
+}
+
+/**
+ * Prepends the swept blocks to the global free lists.
+ */
+void spliceSwept(SweptBlocks& swept) {
+  for (size_t index = 0; index < kSizeClasses; index++) {
+    Block* head = swept.heads[index];
+    if (head == nullptr) {
+      continue;
+    }
+
+    Block* tail = swept.tails[index];
+    setNextFree(tail, freeLists[index]);
+    if (freeLists[index] != nullptr) {
+      setPrevFree(freeLists[index], tail);
+    }
+    freeLists[index] = head;
+
+    nonEmptyClasses |= uint64_t(1) << index;
+  }
+
+  usedBytes -= swept.freedBytes;
+  gcStats.freedBytes += swept.freedBytes;
+}
+
+/**
+ * Sweeps a small chunk from its bitmaps. Dead blocks are the starts
+ * without a mark: bitmap words with none are skipped at once, so fully
+ * live (or free) regions cost one test per 64 granules, and live
+ * headers are never touched. Each dead block is merged with the free
+ * and dead blocks following it, up to the next marked one.
+ *
+ * Touches nothing but the chunk and `swept`, so different chunks can
+ * be swept by different threads.
+ */
+void sweepChunk(Chunk* chunk, SweptBlocks& swept) {
+  ChunkBitmaps* bits = bitmaps(chunk);
+  size_t limit = granule(chunk, chunk->bump);
+  size_t index = granule(chunk, blocksStart(chunk));
+
+  while (index < limit) {
+    size_t word = index / 64;
+    uint64_t dead = bits->starts[word] & ~bits->marks[word] & (~uint64_t(0) << (index % 64));
+    if (dead == 0) {
+      index = (word + 1) * 64;
+      continue;
+    }
+
+    size_t from = word * 64 + __builtin_ctzll(dead);
+    if (from >= limit) {
+      break;
+    }
+
+    size_t to = from;
+    do {
+      Block* block = (Block*)granuleAddress(chunk, to);
+      if (isUsed(block)) {
+        swept.freedBytes += getSize(block);
+      }
+      to += allocSize(getSize(block)) / sizeof(word_t);
+    } while (to < limit && !testBit(bits->marks, to));
+
+    // The free end of the current chunk goes back to the bump area.
+    // (All the others are bumped up to their end, see `retireChunkTail`.)
+    if (to == limit && chunk->bump != chunk->end) {
+      clearBits(bits->starts, from, limit);
+      chunk->bump = granuleAddress(chunk, from);
+      break;
+    }
+
+    addSwept(swept, freeRange(chunk, granuleAddress(chunk, from), granuleAddress(chunk, to)));
+    index = to;
+  }
+
+  memset(bits->marks, 0, sizeof(bits->marks));
+}
+
+/**
+ * Lazy sweeping: the sweep phase only queues the small chunks as
+ * unswept, and the allocations sweep them one at a time, just as many
+ * as the free lists need. The pause after a marking no longer depends
+ * on the heap size, and the blocks just freed are reused at once,
+ * while still in the cache.
+ *
+ * The blocks of an unswept chunk are never allocated: the free lists
+ * only hold blocks of swept chunks, and the current chunk (the one
+ * bumped in) is swept right away. Its marks stay valid until it's
+ * swept, and all chunks are before the next marking starts.
+ */
+static bool lazySweep = false;
+static std::vector<Chunk*> unsweptChunks;
+
+/**
+ * Concurrent sweeping: a background thread takes the unswept chunks
+ * as well, and queues the free blocks it finds for the mutator to
+ * splice (only the mutator touches the global free lists). Both queues
+ * are guarded by `sweepLock`. The chunks queued and not spliced yet
+ * are counted by the mutator.
+ */
+static std::mutex sweepLock;
+static std::condition_variable sweeperWakeup;
+static std::vector<SweptBlocks> sweptQueue;
+static size_t pendingChunks = 0;
+static bool sweeperStop = false;
+static std::thread sweeper;
+
+/**
+ * Once every chunk is swept, the live size is known (the bytes
+ * allocated since the marking are all live), and so is the next
+ * threshold.
+ */
+void sweepFinished() {
+  gcStats.liveBytes = usedBytes - allocatedSinceGC;
+  gcThreshold = gcStats.liveBytes > minGcThreshold ? gcStats.liveBytes : minGcThreshold;
+}
+
+/**
+ * Splices the blocks of a queued chunk once swept.
+ */
+void chunkSwept(SweptBlocks& swept) {
+  spliceSwept(swept);
+
+  if (--pendingChunks == 0) {
+    sweepFinished();
+  }
+}
+
+/**
+ * Splices the chunks the sweeping thread is done with.
+ * Returns whether there were any.
+ */
+bool collectSwept() {
+  std::vector<SweptBlocks> done;
+  {
+    std::lock_guard<std::mutex> guard(sweepLock);
+    done.swap(sweptQueue);
+  }
+
+  for (auto& swept : done) {
+    gcStats.concurrentSweeps++;
+    chunkSwept(swept);
+  }
+  return !done.empty();
+}
+
+/**
+ * Splices the chunks swept by the sweeping thread, or if none, sweeps
+ * the next unswept one. Returns false when there's nothing to do.
+ */
+bool sweepNextChunk() {
+  if (pendingChunks == 0) {
+    return false;
+  }
+
+  if (collectSwept()) {
+    return true;
+  }
+
+  Chunk* chunk;
+  {
+    std::lock_guard<std::mutex> guard(sweepLock);
+    if (unsweptChunks.empty()) {
+      return false;
+    }
+    chunk = unsweptChunks.back();
+    unsweptChunks.pop_back();
+  }
+
+  SweptBlocks swept{};
+  sweepChunk(chunk, swept);
+  gcStats.lazySweeps++;
+  chunkSwept(swept);
+  return true;
+}
+
+/**
+ * Sweeps all the chunks left.
+ */
+void finishSweep() {
+  while (pendingChunks > 0) {
+    if (!sweepNextChunk()) {
+      // The last ones are being swept by the sweeping thread.
+      std::this_thread::yield();
+    }
+  }
+}
+
+/**
+ * Sweeps chunks until one frees a block of (at least) `size` bytes.
+ */
+Block* sweepFor(size_t size) {
+  while (sweepNextChunk()) {
+    Block* block = findBlock(size);
+    if (block != nullptr) {
+      return block;
+    }
+  }
+  return nullptr;
+}
+
+void setLazySweep(bool enable) {
+  if (!enable) {
+    finishSweep();
+  }
+  lazySweep = enable;
+}
+
+/**
+ * The sweeping thread: sweeps the queued chunks one by one.
+ */
+void sweeperLoop() {
+  std::unique_lock<std::mutex> lock(sweepLock);
+
+  for (;;) {
+    sweeperWakeup.wait(lock, []() { return sweeperStop || !unsweptChunks.empty(); });
+    if (sweeperStop) {
+      return;
+    }
+
+    Chunk* chunk = unsweptChunks.back();
+    unsweptChunks.pop_back();
+    lock.unlock();
+
+    SweptBlocks swept{};
+    sweepChunk(chunk, swept);
+
+    lock.lock();
+    sweptQueue.push_back(swept);
+  }
+}
+
+/**
+ * Starts or stops the sweeping thread. While it runs, the chunks are
+ * queued after each marking, and swept while the mutator proceeds
+ * (the allocations may still sweep some lazily).
+ */
+void enableConcurrentSweep(bool enable) {
+  if (enable == sweeper.joinable()) {
+    return;
+  }
+
+  if (enable) {
+    sweeperStop = false;
+    sweeper = std::thread(sweeperLoop);
+    return;
+  }
+
+  finishSweep();
+  {
+    std::lock_guard<std::mutex> guard(sweepLock);
+    sweeperStop = true;
+  }
+  sweeperWakeup.notify_one();
+  sweeper.join();
+}
+
+// ---------------------------------------------------------
+// Parallel sweeping
+
+/**
+ * Threads used by an eager sweep, the calling one included.
+ */
+static size_t sweepThreads = 1;
+
+void setSweepThreads(size_t threads) {
+  sweepThreads = threads > 0 ? threads : 1;
+}
+
+/**
+ * Chunks of the current parallel sweep, the index of the next one to
+ * take, and the free blocks found by each worker.
+ */
+static std::vector<Chunk*> chunksToSweep;
+static std::atomic<size_t> nextToSweep{0};
+static std::vector<SweptBlocks> sweptByWorker;
+
+void sweepWorker(size_t id) {
+  for (;;) {
+    size_t index = nextToSweep.fetch_add(1, std::memory_order_relaxed);
+    if (index >= chunksToSweep.size()) {
+      return;
+    }
+    sweepChunk(chunksToSweep[index], sweptByWorker[id]);
+  }
+}
+
+/**
+ * Sweeps `chunksToSweep`: the workers take the chunks one at a time
+ * (so uneven ones balance out), each into free lists of its own,
+ * spliced into the global ones once all are done.
+ */
+void sweepChunks() {
+  size_t threads = std::min(sweepThreads, chunksToSweep.size());
+  sweptByWorker.assign(threads, SweptBlocks{});
+  nextToSweep.store(0);
+
+  std::vector<std::thread> workers;
+  for (size_t id = 1; id < threads; id++) {
+    workers.emplace_back(sweepWorker, id);
+  }
+  if (threads > 0) {
+    sweepWorker(0);
+  }
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  for (auto& swept : sweptByWorker) {
+    spliceSwept(swept);
+  }
+  chunksToSweep.clear();
+}
+
+/**
+ * Sweep phase: rebuilds the free lists from the unmarked blocks of
+ * every chunk (or queues the chunks for a lazy or concurrent sweep),
+ * and unmaps the dead large objects.
+ */
+void sweep() {
+  for (auto& list : freeLists) {
+    list = nullptr;
+  }
+  nonEmptyClasses = 0;
+
+  bool deferred = lazySweep || sweeper.joinable();
+  std::vector<Chunk*> queued;
+
+  Chunk** link = &chunks;
+  while (*link != nullptr) {
+    Chunk* chunk = *link;
+
+    if (!chunk->large) {
+      if (deferred && chunk != current) {
+        queued.push_back(chunk);
+      } else {
+        chunksToSweep.push_back(chunk);
+      }
+    } else if (chunk->largeMarked) {
+      chunk->largeMarked = false;
+    } else {
+      Block* block = (Block*)blocksStart(chunk);
+      usedBytes -= getSize(block);
+      gcStats.freedBytes += getSize(block);
+
+      *link = chunk->next;
+      munmap(chunk, chunk->size);
+      continue;
+    }
+
+    link = &chunk->next;
+  }
+
+  sweepChunks();
+
+  if (queued.empty()) {
+    sweepFinished();
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(sweepLock);
+    unsweptChunks.insert(unsweptChunks.end(), queued.begin(), queued.end());
+  }
+  pendingChunks += queued.size();
+  sweeperWakeup.notify_one();
+}
+
+// ---------------------------------------------------------
+// Concurrent marking
+
+/**
+ * A background thread does the marking while the mutator runs. The
+ * mutator only stops for two short phases: shading the roots at the
+ * start, and the final remark. It keeps the snapshot at the beginning
+ * (SATB) of the object graph: every reference overwritten during the
+ * marking is logged by the write barrier, so everything reachable when
+ * the marking started gets marked, and new objects are allocated black.
+ *
+ * The barrier logs into a local buffer; full buffers are handed to the
+ * marking thread in batches, so the barrier takes no lock.
+ */
+static constexpr size_t kSatbBufferSize = 256;
+
+static std::vector<word_t> satbBuffer;
+
+/**
+ * State shared with the marking thread, guarded by `markerLock`.
+ */
+static std::mutex markerLock;
+static std::condition_variable markerWakeup;
+static std::vector<std::vector<word_t>> satbQueue;
+static bool markerActive = false;
+static bool markerStop = false;
+
+/**
+ * Set by the marking thread when it ran out of grey objects.
+ */
+static std::atomic<bool> tracingDone{false};
+
+static std::thread marker;
+
+/**
+ * SATB barrier: logs the value a store overwrites.
+ */
+void logOverwritten(word_t value) {
+  if (!isPointer(value)) {
+    return;
+  }
+
+  satbBuffer.push_back(value);
+  if (satbBuffer.size() >= kSatbBufferSize) {
+    std::lock_guard<std::mutex> guard(markerLock);
+    satbQueue.push_back(std::move(satbBuffer));
+    satbBuffer.clear();
+  }
+}
+
+/**
+ * The marking thread: traces from the grey objects and the logged
+ * buffers until there are no more, then waits for the next cycle.
+ */
+void markerLoop() {
+  std::unique_lock<std::mutex> lock(markerLock);
+
+  for (;;) {
+    markerWakeup.wait(lock, []() { return markerStop || markerActive; });
+    if (markerStop) {
+      return;
+    }
+
+    do {
+      std::vector<std::vector<word_t>> buffers;
+      buffers.swap(satbQueue);
+      lock.unlock();
+
+      for (auto& buffer : buffers) {
+        for (word_t value : buffer) {
+          markValue(value);
+        }
+      }
+      drainMarkStack(SIZE_MAX);
+
+      lock.lock();
+    } while (!satbQueue.empty());
+
+    markerActive = false;
+    tracingDone.store(true, std::memory_order_release);
+  }
+}
+
+/**
+ * Starts or stops the marking thread. Collections started while it
+ * runs are concurrent.
+ */
+void enableConcurrentMarking(bool enable) {
+  if (enable == marker.joinable()) {
+    return;
+  }
+
+  if (enable) {
+    markerStop = false;
+    marker = std::thread(markerLoop);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(markerLock);
+    markerStop = true;
+  }
+  markerWakeup.notify_one();
+  marker.join();
+}
+
+/**
+ * First pause: shades the roots, and lets the marking thread go.
+ */
+void startConcurrentMarking() {
+  gcPhase = GCPhase::ConcurrentMarking;
+
+  for (word_t* slot : roots) {
+    markValue(*slot);
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(markerLock);
+    tracingDone.store(false, std::memory_order_relaxed);
+    markerActive = true;
+  }
+  markerWakeup.notify_one();
+}
+
+void finishCycle();
+
+/**
+ * Final pause, once the marking thread is done: the remaining logged
+ * values and the roots are marked by the mutator itself, then the
+ * heap is swept.
+ */
+void finishConcurrentMarking() {
+  std::lock_guard<std::mutex> guard(markerLock);
+
+  for (auto& buffer : satbQueue) {
+    for (word_t value : buffer) {
+      markValue(value);
+    }
+  }
+  satbQueue.clear();
+
+  for (word_t value : satbBuffer) {
+    markValue(value);
+  }
+  satbBuffer.clear();
+
+  for (word_t* slot : roots) {
+    markValue(*slot);
+  }
+  drainMarkStack(SIZE_MAX);
+
+  finishCycle();
+}
+
+/**
+ * Sweeps after a complete mark (or starts a lazy sweep).
+ */
+void finishCycle() {
+  gcPhase = GCPhase::Idle;
+  gcStats.collections++;
+  allocatedSinceGC = 0;
+
+  sweep();
+}
+
+/**
+ * Whether the allocations since the last cycle call for a new one.
+ * The threshold is only set once the heap is all swept, so a lazy
+ * sweep in progress is finished first.
+ */
+bool shouldCollect() {
+  if (allocatedSinceGC < gcThreshold) {
+    return false;
+  }
+
+  finishSweep();
+  return allocatedSinceGC >= gcThreshold;
+}
+
+/**
+ * Full collection. Completes the marking in progress, if any.
+ */
+void gc() {
+  if (gcPhase == GCPhase::ConcurrentMarking) {
+    while (!tracingDone.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+    finishConcurrentMarking();
+    return;
+  }
+
+  // The marks of the last cycle must be all swept.
+  finishSweep();
+
+  if (markThreads > 1) {
+    parallelMark();
+  } else {
+    mark();
+  }
+  finishCycle();
+}
+
+/**
+ * Allocates a block of memory of (at least) `size` bytes. The payload
+ * is zeroed: it's scanned for references, stale values must not
+ * look like pointers. May run a collection first.
+ */
+word_t* alloc(size_t size)
+{
+  size = align(size);
+  if (size < kMinPayloadSize)
+  {
+    size = kMinPayloadSize;
+  }
+
+  if (gcPhase == GCPhase::Marking)
+  {
+    markSlice(markBudget);
+  }
+  else if (gcPhase == GCPhase::ConcurrentMarking)
+  {
+    if (tracingDone.load(std::memory_order_acquire))
+    {
+      finishConcurrentMarking();
+    }
+  }
+  else if (shouldCollect())
+  {
+    if (marker.joinable())
+    {
+      startConcurrentMarking();
+    }
+    else if (incremental)
+    {
+      startMarking();
+    }
+    else
+    {
+      gc();
+    }
+  }
+
+  Block* block;
+
+  // ---------------------------------------------------------
+  // 1. Large objects get their own chunk:
+
+  if (allocSize(size) > kLargeObjectThreshold)
+  {
+    block = allocLarge(size);
+  }
+
+  // ---------------------------------------------------------
+  // 2. Search for an available free block, sweeping lazily
+  //    the chunks not swept yet if none:
+
+  else if ((block = findBlock(size)) != nullptr || (block = sweepFor(size)) != nullptr)
+  {
+    removeFree(block);
+    split(block, size);
+  }
+
+  // ---------------------------------------------------------
+  // 3. If block not found in the free list, request from OS:
+
+  else
+  {
+    block = requestFromOS(size);
+  }
+
+  if (block == nullptr)
+  {
+    return nullptr;
+  }
+
+  setUsed(block, true);
+  usedBytes += getSize(block);
+
+  // Allocated black during a marking.
+  if (gcPhase != GCPhase::Idle)
+  {
+    setMarked(block);
+  }
+
+  allocatedSinceGC += getSize(block);
+  memset(block->data, 0, getSize(block));
+
+  return block->data;
+}
+
+/**
+ * Whether a payload of a small chunk belongs to a used block,
+ * i.e. wasn't reclaimed (nor reused yet).
+ */
+bool isAllocated(word_t* data) {
+  Block* block = getHeader(data);
+  Chunk* chunk = chunkOf(block);
+
+  return (char*)block < chunk->bump && testBit(bitmaps(chunk)->starts, granule(chunk, block)) &&
+         isUsed(block);
+}
+
+/**
+ * Validates the heap: blocks of each chunk add up to its bump pointer
+ * with a start bit each (and none inside), no two adjacent blocks are
+ * free, no marks are left, and the free lists hold exactly the free
+ * blocks.
+ */
+bool checkHeap() {
+  size_t freeBlocks = 0;
+
+  for (Chunk* chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+    if (chunk->large) {
+      if (chunk->largeMarked) {
+        return false;
+      }
+      continue;
+    }
+
+    ChunkBitmaps* bits = bitmaps(chunk);
+    for (uint64_t word : bits->marks) {
+      if (word != 0) {
+        return false;
+      }
+    }
+
+    size_t blocks = 0;
+    bool prevFree = false;
+    char* cursor = blocksStart(chunk);
+
+    while (cursor < chunk->bump) {
+      Block* block = (Block*)cursor;
+      if (!testBit(bits->starts, granule(chunk, block))) {
+        return false;
+      }
+      if (!isUsed(block)) {
+        if (prevFree) {
+          return false;
+        }
+        freeBlocks++;
+      }
+
+      prevFree = !isUsed(block);
+      blocks++;
+      cursor += allocSize(getSize(block));
+    }
+
+    size_t starts = 0;
+    for (uint64_t word : bits->starts) {
+      starts += __builtin_popcountll(word);
+    }
+
+    if (cursor != chunk->bump || starts != blocks) {
+      return false;
+    }
+  }
+
+  for (Block* list : freeLists) {
+    for (Block* block = list; block != nullptr; block = nextFree(block)) {
+      if (isUsed(block)) {
+        return false;
+      }
+      freeBlocks--;
+    }
+  }
+
+  return freeBlocks == 0;
+}
+
+#define USE_MARK_SWEEP
+#define USE_INCREMENTAL
+#define USE_CONCURRENT
+#define USE_PARALLEL_MARKING
+#define USE_LAZY_SWEEP
+#define USE_PARALLEL_SWEEP
+
+int main()
+{
+#ifdef USE_MARK_SWEEP
+  {
+    // --------------------------------------
+    // Test case 1: Unreachable blocks are reclaimed
+    //
+    word_t* a = alloc(16);
+    word_t* b = alloc(16);
+    word_t* c = alloc(16);
+    word_t* d = alloc(16);
+
+    addRoot((word_t*)&a);
+    addRoot((word_t*)&d);
+    gc();
+
+    assert(isAllocated(a) && isAllocated(d));
+    assert(!isMarked(getHeader(a)));
+    assert(!isAllocated(b) && !isAllocated(c));
+
+    // b and c are adjacent and merged into one free block:
+    assert(getSize(getHeader(b)) == 16 + allocSize(16));
+    assert(checkHeap());
+
+    // Marking doesn't write to the headers:
+    size_t header = getHeader(a)->sizeAndFlags;
+    gc();
+    assert(getHeader(a)->sizeAndFlags == header);
+
+    // --------------------------------------
+    // Test case 2: Transitive references and cycles
+    //
+    word_t* x = alloc(16);
+    word_t* y = alloc(16);
+    word_t* z = alloc(16);
+    assert(x == b); // reused, and split
+
+    a[0] = (word_t)x;
+    x[0] = (word_t)y;
+    y[0] = (word_t)a; // cycle a -> x -> y -> a
+    y[1] = tagInt(42);
+
+    z[0] = (word_t)z; // unreachable self-cycle
+
+    gc();
+
+    assert(isAllocated(x) && isAllocated(y));
+    assert(!isAllocated(z));
+    assert(untagInt(y[1]) == 42);
+    assert(checkHeap());
+
+    // The dead end of the chunk went back to the bump area:
+    word_t* w = alloc(16);
+    assert(w == z);
+
+    // --------------------------------------
+    // Test case 3: Immediates are not followed
+    //
+    // A tagged integer that happens to be an address plus one
+    // doesn't keep anything alive.
+    //
+    word_t* v = alloc(16);
+    a[1] = (word_t)v | 1;
+    gc();
+    assert(!isAllocated(v));
+    assert(!isAllocated(w));
+
+    removeRoot((word_t*)&a);
+    removeRoot((word_t*)&d);
+    gc();
+    assert(!isAllocated(a) && !isAllocated(x) && !isAllocated(d));
+    assert(checkHeap());
+  }
+
+  {
+    // --------------------------------------
+    // Test case 4: Automatic collections
+    //
+    // A long list stays alive while much more garbage is allocated:
+    // collections are triggered by the allocation volume, and the
+    // heap doesn't grow with the garbage.
+    //
+    setGcThreshold(256 * 1024);
+    size_t collections = gcStats.collections;
+
+    word_t* list = nullptr;
+    addRoot((word_t*)&list);
+
+    for (intptr_t i = 0; i < 10000; i++) {
+      word_t* node = alloc(16);
+      node[0] = tagInt(i);
+      node[1] = (word_t)list;
+      list = node;
+
+      alloc(200); // garbage
+    }
+
+    assert(gcStats.collections > collections);
+
+    size_t mapped = 0;
+    for (Chunk* chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+      mapped += chunk->size;
+    }
+    assert(mapped <= 4 * kChunkSize);
+
+    intptr_t expected = 9999;
+    for (word_t* node = list; node != nullptr; node = (word_t*)node[1]) {
+      assert(untagInt(node[0]) == expected--);
+    }
+    assert(expected == -1);
+
+    removeRoot((word_t*)&list);
+    gc();
+    assert(gcStats.liveBytes == 0);
+    assert(checkHeap());
+  }
+
+  {
+    // --------------------------------------
+    // Test case 5: Large objects
+    //
+    // Live ones are kept (and their references followed),
+    // dead ones are unmapped.
+    //
+    word_t* big = nullptr;
+    addRoot((word_t*)&big);
+
+    big = alloc(kChunkSize);
+    word_t* dead = alloc(kChunkSize);
+    Chunk* bigChunk = chunkOf(getHeader(big));
+    assert(bigChunk->large && bigChunk != chunkOf(getHeader(dead)));
+
+    word_t* small = alloc(16);
+    big[kChunkSize / sizeof(word_t) - 1] = (word_t)small;
+    gc();
+
+    size_t largeChunks = 0;
+    for (Chunk* chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+      largeChunks += chunk->large;
+    }
+    assert(largeChunks == 1);
+    assert(!bigChunk->largeMarked);
+    assert(isAllocated(small));
+
+    removeRoot((word_t*)&big);
+    gc();
+    assert(!isAllocated(small));
+    assert(checkHeap());
+  }
+#endif
+
+#ifdef USE_INCREMENTAL
+  {
+    // --------------------------------------
+    // Test case 6: Incremental marking
+    //
+    // The write barrier keeps an object alive when its only reference
+    // moves from a grey object to a black one during marking.
+    //
+    setIncremental(true, 2);
+
+    word_t* a = alloc(16);
+    word_t* b = alloc(16);
+    word_t* c = alloc(16);
+    b[0] = (word_t)c;
+
+    addRoot((word_t*)&b);
+    addRoot((word_t*)&a);
+
+    startMarking();
+    assert(!markSlice(2)); // a is scanned (black), b is still grey
+
+    writeRef(a, 0, (word_t)c);
+    writeRef(b, 0, 0);
+
+    while (!markSlice(2)) {
+    }
+    assert(gcPhase == GCPhase::Idle);
+    assert(isAllocated(c) && a[0] == (word_t)c);
+    assert(checkHeap());
+
+    removeRoot((word_t*)&a);
+    removeRoot((word_t*)&b);
+
+    // --------------------------------------
+    // Test case 7: Bounded slices
+    //
+    // A long list is built while collections run in slices on
+    // allocations: no slice scans much more than the budget, and
+    // nothing live is lost.
+    //
+    setIncremental(true, 256);
+    setGcThreshold(64 * 1024);
+    size_t collections = gcStats.collections;
+    size_t slices = gcStats.slices;
+    gcStats.maxSliceWords = 0;
+
+    word_t* list = nullptr;
+    addRoot((word_t*)&list);
+
+    for (intptr_t i = 0; i < 20000; i++) {
+      word_t* node = alloc(16);
+      writeRef(node, 0, tagInt(i));
+      writeRef(node, 1, (word_t)list);
+      list = node;
+
+      alloc(48); // garbage
+    }
+
+    assert(gcStats.collections > collections + 1);
+    assert(gcStats.slices > slices + 100);
+    assert(gcStats.maxSliceWords <= 256 + 2);
+
+    intptr_t expected = 19999;
+    for (word_t* node = list; node != nullptr; node = (word_t*)node[1]) {
+      assert(untagInt(node[0]) == expected--);
+    }
+    assert(expected == -1);
+
+    removeRoot((word_t*)&list);
+    gc();
+    assert(gcStats.liveBytes == 0);
+    assert(checkHeap());
+
+    setIncremental(false);
+  }
+#endif
+
+#ifdef USE_CONCURRENT
+  {
+    // --------------------------------------
+    // Test case 8: Concurrent marking
+    //
+    // The mutator keeps moving references between two tables while
+    // the marking thread runs: an object whose only reference moves
+    // from a table not yet scanned to one already scanned is kept
+    // alive by the SATB barrier. Every object is stamped with its
+    // slot, so a reclaimed (and reused) one would be noticed.
+    //
+    enableConcurrentMarking(true);
+    setGcThreshold(64 * 1024);
+    size_t collections = gcStats.collections;
+
+    const size_t slots = 512;
+    word_t* tables[2] = {nullptr, nullptr};
+    addRoot((word_t*)&tables[0]);
+    addRoot((word_t*)&tables[1]);
+    tables[0] = alloc(slots * sizeof(word_t));
+    tables[1] = alloc(slots * sizeof(word_t));
+
+    unsigned seed = 1;
+    for (int round = 0; round < 200000; round++) {
+      size_t i = rand_r(&seed) % slots;
+      size_t from = rand_r(&seed) % 2;
+      word_t* source = tables[from];
+      word_t* target = tables[1 - from];
+
+      if (source[i] == 0) {
+        word_t* object = alloc(16);
+        object[0] = tagInt(i);
+        writeRef(source, i, (word_t)object);
+      } else if (target[i] == 0) {
+        word_t value = source[i];
+        writeRef(target, i, value);
+        writeRef(source, i, 0);
+      } else {
+        writeRef(source, i, 0); // garbage
+      }
+
+      for (word_t* table : tables) {
+        if (table[i] != 0) {
+          assert(untagInt(((word_t*)table[i])[0]) == (intptr_t)i);
+        }
+      }
+    }
+
+    assert(gcStats.collections > collections + 1);
+
+    gc();
+    for (word_t* table : tables) {
+      for (size_t i = 0; i < slots; i++) {
+        if (table[i] != 0) {
+          assert(isAllocated((word_t*)table[i]));
+          assert(untagInt(((word_t*)table[i])[0]) == (intptr_t)i);
+        }
+      }
+    }
+
+    removeRoot((word_t*)&tables[0]);
+    removeRoot((word_t*)&tables[1]);
+    enableConcurrentMarking(false);
+    gc();
+    assert(gcStats.liveBytes == 0);
+    assert(checkHeap());
+  }
+#endif
+
+#ifdef USE_PARALLEL_MARKING
+  {
+    // --------------------------------------
+    // Test case 9: Parallel marking
+    //
+    // A wide tree is marked by several threads: exactly the same
+    // blocks survive as with a single one.
+    //
+    word_t* tree = nullptr;
+    addRoot((word_t*)&tree);
+
+    // Each node: 8 children, and a tag.
+    std::vector<word_t*> level;
+    tree = alloc(9 * sizeof(word_t));
+    level.push_back(tree);
+
+    for (int depth = 0; depth < 4; depth++) {
+      std::vector<word_t*> next;
+      for (word_t* node : level) {
+        for (size_t i = 0; i < 8; i++) {
+          word_t* child = alloc(9 * sizeof(word_t));
+          child[8] = tagInt(depth);
+          node[i] = (word_t)child;
+          next.push_back(child);
+
+          alloc(32); // garbage
+        }
+      }
+      level.swap(next);
+    }
+
+    // Long chains hanging from the leaves, so there's work to steal.
+    for (size_t i = 0; i < level.size(); i += 64) {
+      word_t* node = level[i];
+      for (int j = 0; j < 1000; j++) {
+        word_t* link = alloc(9 * sizeof(word_t));
+        node[0] = (word_t)link;
+        node = link;
+      }
+    }
+
+    auto countMarks = [](bool clear) {
+      size_t marked = 0;
+      for (Chunk* chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+        if (chunk->large) {
+          marked += chunk->largeMarked;
+          chunk->largeMarked &= !clear;
+          continue;
+        }
+        for (uint64_t word : bitmaps(chunk)->marks) {
+          marked += __builtin_popcountll(word);
+        }
+        if (clear) {
+          memset(bitmaps(chunk)->marks, 0, sizeof(bitmaps(chunk)->marks));
+        }
+      }
+      return marked;
+    };
+
+    setMarkThreads(1);
+    mark();
+    size_t serialMarks = countMarks(true);
+
+    setMarkThreads(4);
+    parallelMark();
+    size_t parallelMarks = countMarks(false);
+    assert(parallelMarks == serialMarks);
+    assert(serialMarks > 4096 + 8000);
+
+    sweep();
+    gcPhase = GCPhase::Idle;
+    assert(checkHeap());
+
+    // A full collection on 4 threads, twice: nothing more is freed.
+    gc();
+    size_t live = gcStats.liveBytes;
+    gc();
+    assert(gcStats.liveBytes == live);
+
+    removeRoot((word_t*)&tree);
+    gc();
+    assert(gcStats.liveBytes == 0);
+    assert(checkHeap());
+
+    setMarkThreads(1);
+  }
+#endif
+
+#ifdef USE_LAZY_SWEEP
+  {
+    // --------------------------------------
+    // Test case 10: Lazy sweeping
+    //
+    // A collection over several chunks of garbage only queues them:
+    // the allocations sweep one chunk at a time, when the free lists
+    // run out, and reuse the blocks just freed.
+    //
+    setGcThreshold(size_t(64) << 20);
+    setLazySweep(true);
+
+    word_t* list = nullptr;
+    addRoot((word_t*)&list);
+
+    for (intptr_t i = 0; i < 20000; i++) {
+      word_t* node = alloc(16);
+      node[0] = tagInt(i);
+      node[1] = (word_t)list;
+      list = node;
+
+      alloc(64); // garbage
+    }
+
+    gc();
+    size_t queued = unsweptChunks.size();
+    size_t lazySweeps = gcStats.lazySweeps;
+    assert(queued > 2);
+
+    // The free lists are empty until a chunk is swept.
+    word_t* reused = alloc(64);
+    assert(gcStats.lazySweeps == lazySweeps + 1);
+    assert(unsweptChunks.size() == queued - 1);
+    assert(isAllocated(reused));
+
+    // Served by the same chunk, while it has free blocks.
+    alloc(64);
+    assert(gcStats.lazySweeps == lazySweeps + 1);
+
+    size_t live = 0;
+    intptr_t expected = 19999;
+    for (word_t* node = list; node != nullptr; node = (word_t*)node[1]) {
+      assert(untagInt(node[0]) == expected--);
+      live += getSize(getHeader(node));
+    }
+    assert(expected == -1);
+
+    // Finishing the sweep sets the live size of the collection,
+    // as an eager one would.
+    finishSweep();
+    assert(unsweptChunks.empty());
+    assert(gcStats.liveBytes == live);
+    assert(checkHeap());
+
+    // A collection first finishes the lazy sweep in progress.
+    gc();
+    assert(unsweptChunks.size() > 0);
+    removeRoot((word_t*)&list);
+    gc();
+    finishSweep();
+    assert(gcStats.liveBytes == 0);
+    assert(checkHeap());
+
+    setLazySweep(false);
+    setGcThreshold(kChunkSize);
+  }
+#endif
+
+#ifdef USE_PARALLEL_SWEEP
+  {
+    // --------------------------------------
+    // Test case 11: Parallel sweeping
+    //
+    // Chunks of garbage are swept by 4 threads: the same bytes are
+    // freed as by a single one, and the heap is consistent.
+    //
+    setGcThreshold(size_t(64) << 20);
+
+    word_t* list = nullptr;
+    addRoot((word_t*)&list);
+
+    auto build = [&list]() {
+      for (intptr_t i = 0; i < 20000; i++) {
+        word_t* node = alloc(16);
+        node[0] = tagInt(i);
+        node[1] = (word_t)list;
+        list = node;
+
+        alloc(64); // garbage
+      }
+    };
+
+    auto check = [&list]() {
+      size_t live = 0;
+      intptr_t expected = 19999;
+      for (word_t* node = list; node != nullptr; node = (word_t*)node[1]) {
+        assert(untagInt(node[0]) == expected--);
+        live += getSize(getHeader(node));
+      }
+      assert(expected == -1);
+      return live;
+    };
+
+    build();
+    size_t freed = gcStats.freedBytes;
+    gc();
+    size_t serialFreed = gcStats.freedBytes - freed;
+
+    list = nullptr;
+    gc();
+    build();
+    setSweepThreads(4);
+    freed = gcStats.freedBytes;
+    gc();
+    assert(gcStats.freedBytes - freed == serialFreed);
+    assert(gcStats.liveBytes == check());
+    assert(checkHeap());
+
+    // --------------------------------------
+    // Test case 12: Concurrent sweeping
+    //
+    // The chunks are swept by the sweeping thread while the mutator
+    // keeps allocating (and collecting) on its own.
+    //
+    setSweepThreads(1);
+    enableConcurrentSweep(true);
+
+    gc();
+    assert(pendingChunks > 0);
+    while (gcStats.concurrentSweeps == 0) {
+      std::this_thread::yield();
+      collectSwept();
+    }
+    finishSweep();
+    assert(gcStats.liveBytes == check());
+    assert(checkHeap());
+
+    setGcThreshold(64 * 1024);
+    size_t collections = gcStats.collections;
+    list = nullptr;
+    build();
+    assert(gcStats.collections > collections + 1);
+    check();
+
+    removeRoot((word_t*)&list);
+    enableConcurrentSweep(false);
+    gc();
+    finishSweep();
+    assert(gcStats.liveBytes == 0);
+    assert(checkHeap());
+
+    setGcThreshold(kChunkSize);
+  }
+#endif
+
+  puts("\nAll assertions passed!\n");
+  return 0;
+}
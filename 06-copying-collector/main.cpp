@@ -0,0 +1,472 @@
+// Writing a Memory Allocator by Dmitry Soshnikov
+// Copying collector (Cheney's semispace algorithm).
+// This is the collector the sequential allocator of the first chapter
+// relies on: allocation just bumps a pointer through the from-space,
+// and when it reaches the end, the reachable objects are evacuated
+// (breadth-first) to the to-space, and the two spaces are flipped.
+// The cost of a collection is proportional to the live data only,
+// and the garbage is reclaimed all at once.
+// http://dmitrysoshnikov.com/compilers/writing-a-memory-allocator/
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+#include <stdint.h>
+#include <sys/mman.h> // for mmap
+#include <utility> // for std::declval
+#include <vector>
+#include <algorithm>
+
+/**
+ * Machine word size. Depending on the architecture,
+ * can be 4 or 8 bytes.
+ */
+using word_t = intptr_t;
+
+/**
+ * Allocated block of memory. Contains the object header structure,
+ * and the actual payload pointer.
+ */
+struct Block
+{
+
+    // -------------------------------------
+    // 1. Object header
+
+    /**
+     * Block size. Once the block is evacuated, the header instead holds
+     * the new address of the payload (the forwarding pointer), tagged
+     * with `kForwarded`: sizes and addresses are word-aligned, so the
+     * low bit is free.
+     */
+    size_t sizeAndFlags; // 8bytes
+
+    // -------------------------------------
+    // 2. User data
+
+    /**
+     * Payload pointer.
+     */
+    word_t data[1]; // 8bytes
+};
+
+static constexpr size_t kForwarded = 1;
+
+inline size_t getSize(Block* block) {
+  return block->sizeAndFlags;
+}
+
+inline bool isForwarded(Block* block) {
+  return block->sizeAndFlags & kForwarded;
+}
+
+inline word_t* getForward(Block* block) {
+  return (word_t*)(block->sizeAndFlags & ~kForwarded);
+}
+
+inline void setForward(Block* block, word_t* data) {
+  block->sizeAndFlags = (size_t)data | kForwarded;
+}
+
+/**
+ * Aligns the size by the machine word.
+ */
+inline size_t align(size_t n)
+{
+    return (n + sizeof(word_t) - 1) & ~(sizeof(word_t) - 1);
+}
+
+/**
+ * Object header size, without the first data word.
+ */
+static constexpr size_t kHeaderSize = sizeof(Block) - sizeof(std::declval<Block>().data);
+
+/**
+ * Returns total allocation size, reserving in addition the space for
+ * the object header.
+ */
+inline size_t allocSize(size_t size) {
+  return size + kHeaderSize;
+}
+
+/**
+ * Returns the object header.
+ */
+Block* getHeader(word_t* data) {
+  return (Block*)((char*)data - kHeaderSize);
+}
+
+// ---------------------------------------------------------
+// Values
+
+/**
+ * The collector needs to tell references from other data in the
+ * payloads, and moves objects, so the references must be exact:
+ * a word with the low bit set is an immediate (a tagged integer),
+ * zero is null, and anything else is a pointer to a payload.
+ */
+inline bool isPointer(word_t value) {
+  return value != 0 && (value & 1) == 0;
+}
+
+inline word_t tagInt(intptr_t n) {
+  return (word_t)(((uintptr_t)n << 1) | 1);
+}
+
+inline intptr_t untagInt(word_t value) {
+  return value >> 1;
+}
+
+// ---------------------------------------------------------
+// Semispaces
+
+/**
+ * Semispace: a mapped region blocks are bump-allocated in.
+ */
+struct Space
+{
+    char* start;
+    char* end;
+};
+
+/**
+ * Objects are allocated in the from-space, the to-space is
+ * only used during a collection.
+ */
+static Space fromSpace;
+static Space toSpace;
+
+/**
+ * Allocation pointer in the from-space.
+ */
+static char* bump = nullptr;
+
+/**
+ * Size of each semispace.
+ */
+static size_t semispaceSize = size_t(1) << 20;
+
+bool mapSpace(Space& space, size_t size) {
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+
+  space.start = (char*)memory;
+  space.end = space.start + size;
+  return true;
+}
+
+void unmapSpace(Space& space) {
+  munmap(space.start, space.end - space.start);
+  space.start = space.end = nullptr;
+}
+
+/**
+ * Maps both semispaces of `size` bytes each, dropping any previous heap.
+ */
+bool init(size_t size) {
+  if (fromSpace.start != nullptr) {
+    unmapSpace(fromSpace);
+    unmapSpace(toSpace);
+  }
+
+  semispaceSize = size;
+  if (!mapSpace(fromSpace, size) || !mapSpace(toSpace, size)) {
+    return false;
+  }
+
+  bump = fromSpace.start;
+  return true;
+}
+
+// ---------------------------------------------------------
+// Collector
+
+/**
+ * Root set: addresses of the slots (globals, locals of the host
+ * program) that hold values referring to the heap. They're updated
+ * with the new addresses when the objects move.
+ */
+static std::vector<word_t*> roots;
+
+void addRoot(word_t* slot) {
+  roots.push_back(slot);
+}
+
+void removeRoot(word_t* slot) {
+  auto root = std::find(roots.begin(), roots.end(), slot);
+  if (root != roots.end()) {
+    roots.erase(root);
+  }
+}
+
+/**
+ * Collector statistics.
+ */
+struct GCStats
+{
+    size_t collections;
+    size_t liveBytes;
+    size_t copiedBytes;
+};
+
+static GCStats gcStats;
+
+/**
+ * Allocation pointer in the to-space during a collection.
+ */
+static char* copyBump = nullptr;
+
+/**
+ * Copies the object a value refers to into the to-space (once), and
+ * returns the value updated to the new address. The header of the old
+ * copy becomes the forwarding pointer, so all other references to it
+ * are updated to the same copy.
+ */
+word_t evacuate(word_t value) {
+  if (!isPointer(value)) {
+    return value;
+  }
+
+  Block* block = getHeader((word_t*)value);
+  if (isForwarded(block)) {
+    return (word_t)getForward(block);
+  }
+
+  size_t size = allocSize(getSize(block));
+  Block* copy = (Block*)copyBump;
+  memcpy(copy, block, size);
+  copyBump += size;
+
+  gcStats.copiedBytes += getSize(block);
+  setForward(block, copy->data);
+
+  return (word_t)copy->data;
+}
+
+/**
+ * Cheney's algorithm: the to-space between the scan pointer and the
+ * allocation pointer is the queue of grey objects, so the traversal is
+ * breadth-first and needs no stack. Then the spaces are flipped.
+ */
+void gc() {
+  copyBump = toSpace.start;
+
+  for (word_t* slot : roots) {
+    *slot = evacuate(*slot);
+  }
+
+  char* scan = toSpace.start;
+  while (scan < copyBump) {
+    Block* block = (Block*)scan;
+
+    size_t words = getSize(block) / sizeof(word_t);
+    for (size_t i = 0; i < words; i++) {
+      block->data[i] = evacuate(block->data[i]);
+    }
+
+    scan += allocSize(getSize(block));
+  }
+
+  // Flip.
+  std::swap(fromSpace, toSpace);
+  bump = copyBump;
+
+  gcStats.collections++;
+  gcStats.liveBytes = bump - fromSpace.start;
+}
+
+/**
+ * Grows the semispaces so that the live data plus `needed` bytes take
+ * at most half of one. Both bigger semispaces are mapped first (so on
+ * failure the heap is left as it was), the live objects are evacuated
+ * into one, and the other becomes the to-space.
+ */
+bool growHeap(size_t needed) {
+  size_t live = bump - fromSpace.start;
+  size_t size = semispaceSize;
+  while (size < 2 * (live + needed)) {
+    size *= 2;
+  }
+
+  Space bigger;
+  Space otherBigger;
+  if (!mapSpace(bigger, size)) {
+    return false;
+  }
+  if (!mapSpace(otherBigger, size)) {
+    unmapSpace(bigger);
+    return false;
+  }
+
+  unmapSpace(toSpace);
+  toSpace = bigger;
+  gc();
+
+  unmapSpace(toSpace);
+  toSpace = otherBigger;
+
+  semispaceSize = size;
+  return true;
+}
+
+/**
+ * Allocates a block of memory of (at least) `size` bytes: a bump of
+ * the pointer and a limit check. The payload is zeroed: it's scanned
+ * for references, stale values must not look like pointers.
+ */
+word_t* alloc(size_t size)
+{
+  size = align(size);
+
+  if (fromSpace.start == nullptr && !init(semispaceSize))
+  {
+    return nullptr;
+  }
+
+  // ---------------------------------------------------------
+  // 1. Out of the from-space: collect, and grow if still short.
+
+  if (bump + allocSize(size) > fromSpace.end)
+  {
+    gc();
+
+    // OOM. (Out Of Memory)
+    if (bump + allocSize(size) > fromSpace.end || gcStats.liveBytes > semispaceSize / 2)
+    {
+      if (!growHeap(allocSize(size)))
+      {
+        return nullptr;
+      }
+    }
+  }
+
+  // ---------------------------------------------------------
+  // 2. Bump:
+
+  Block* block = (Block*)bump;
+  bump += allocSize(size);
+
+  block->sizeAndFlags = size;
+  memset(block->data, 0, size);
+
+  return block->data;
+}
+
+#define USE_COPYING
+
+int main()
+{
+#ifdef USE_COPYING
+  {
+    // --------------------------------------
+    // Test case 1: Bump allocation
+    //
+    init(size_t(64) << 10);
+
+    auto p1 = alloc(16);
+    auto p2 = alloc(24);
+    assert((char*)p2 == (char*)p1 + allocSize(16));
+    assert(getSize(getHeader(p2)) == 24);
+
+    // --------------------------------------
+    // Test case 2: Evacuation
+    //
+    // The live objects are moved to the other space, roots and
+    // references are updated, shared objects and cycles are
+    // copied once.
+    //
+    word_t* a = alloc(16);
+    word_t* b = alloc(16);
+    word_t* c = alloc(16);
+
+    a[0] = (word_t)b;
+    a[1] = (word_t)c;
+    b[0] = (word_t)c;
+    b[1] = tagInt(7);
+    c[0] = (word_t)a; // cycle
+
+    addRoot((word_t*)&a);
+
+    char* oldFrom = fromSpace.start;
+    gc();
+
+    assert(fromSpace.start != oldFrom && toSpace.start == oldFrom);
+    assert((char*)a >= fromSpace.start && (char*)a < fromSpace.end);
+
+    word_t* newB = (word_t*)a[0];
+    word_t* newC = (word_t*)a[1];
+    assert((word_t)newC == newB[0]);
+    assert(newC[0] == (word_t)a);
+    assert(untagInt(newB[1]) == 7);
+
+    // p1, p2 are garbage: only a, b, c are copied.
+    assert(gcStats.liveBytes == 3 * allocSize(16));
+
+    // Breadth-first: a, then its children.
+    assert((char*)newB == (char*)a + allocSize(16));
+    assert((char*)newC == (char*)newB + allocSize(16));
+
+    // --------------------------------------
+    // Test case 3: Collections on exhaustion
+    //
+    // Lots of garbage with a live list: the space is recycled, and the
+    // list survives the collections intact.
+    //
+    word_t* list = nullptr;
+    addRoot((word_t*)&list);
+
+    size_t collections = gcStats.collections;
+    for (intptr_t i = 0; i < 10000; i++) {
+      word_t* node = alloc(16);
+      node[0] = tagInt(i);
+      node[1] = (word_t)list;
+      list = node;
+
+      alloc(100); // garbage
+      if (i == 500) {
+        // Drops the first 500 nodes.
+        ((word_t*)list)[1] = 0;
+      }
+    }
+
+    assert(gcStats.collections > collections);
+
+    intptr_t expected = 9999;
+    for (word_t* node = list; node != nullptr; node = (word_t*)node[1]) {
+      assert(untagInt(node[0]) == expected--);
+    }
+    assert(expected == 499);
+
+    // --------------------------------------
+    // Test case 4: Growing
+    //
+    // Live data beyond half of a semispace grows both.
+    //
+    size_t size = semispaceSize;
+    for (intptr_t i = 0; i < 10000; i++) {
+      word_t* node = alloc(16);
+      node[0] = tagInt(i);
+      node[1] = (word_t)list;
+      list = node;
+    }
+    assert(semispaceSize > size);
+    assert(gcStats.liveBytes <= semispaceSize / 2);
+    assert(untagInt(list[0]) == 9999);
+
+    removeRoot((word_t*)&list);
+    gc();
+    assert(gcStats.liveBytes == 3 * allocSize(16));
+
+    removeRoot((word_t*)&a);
+    gc();
+    assert(gcStats.liveBytes == 0 && bump == fromSpace.start);
+  }
+#endif
+
+  puts("\nAll assertions passed!\n");
+  return 0;
+}
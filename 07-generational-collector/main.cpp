@@ -0,0 +1,1291 @@
+// Writing a Memory Allocator by Dmitry Soshnikov
+// Generational collector.
+// Most objects die young, so the heap is split in two generations.
+// New objects are bump-allocated in a nursery (the sequential allocator
+// of the first chapter). A minor collection evacuates the survivors of
+// the nursery into the old space, a free-list heap (the segregated fit
+// of chapter 03), and resets the nursery. It only traces from the roots
+// and from the cards of the old space that were written a young
+// reference to, so its pause doesn't depend on the old space size.
+// The old space itself is collected by the mark-sweep of chapter 05,
+// far less often.
+// http://dmitrysoshnikov.com/compilers/writing-a-memory-allocator/
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+#include <stdint.h>
+#include <unistd.h> // for sysconf
+#include <sys/mman.h> // for mmap
+#include <utility> // for std::declval
+#include <vector>
+#include <algorithm>
+
+/**
+ * Machine word size. Depending on the architecture,
+ * can be 4 or 8 bytes.
+ */
+using word_t = intptr_t;
+
+/**
+ * Allocated block of memory. Contains the object header structure,
+ * and the actual payload pointer.
+ */
+struct Block
+{
+
+    // -------------------------------------
+    // 1. Object header
+
+    /**
+     * Block size. Sizes are aligned by the machine word, so the
+     * low bits are always zero and keep the block flags instead.
+     */
+    size_t sizeAndFlags; // 8bytes
+
+    // -------------------------------------
+    // 2. User data
+
+    /**
+     * Payload pointer.
+     */
+    word_t data[1]; // 8bytes
+};
+
+/**
+ * Block flags, stored in the low bits of `Block::sizeAndFlags`.
+ */
+static constexpr size_t kUsed = 1; // the (old) block is allocated
+static constexpr size_t kFlagsMask = kUsed;
+
+/**
+ * A nursery object that was evacuated has the new payload address in
+ * its header instead, tagged with this bit. Nursery blocks have no
+ * other flags, so it doesn't clash with `kUsed`.
+ */
+static constexpr size_t kForwarded = 1;
+
+inline size_t getSize(Block* block) {
+  return block->sizeAndFlags & ~kFlagsMask;
+}
+
+inline void setSize(Block* block, size_t size) {
+  block->sizeAndFlags = size | (block->sizeAndFlags & kFlagsMask);
+}
+
+inline void setFlag(Block* block, size_t flag, bool value) {
+  block->sizeAndFlags = value ? block->sizeAndFlags | flag : block->sizeAndFlags & ~flag;
+}
+
+inline bool isUsed(Block* block) {
+  return block->sizeAndFlags & kUsed;
+}
+
+inline void setUsed(Block* block, bool used) {
+  setFlag(block, kUsed, used);
+}
+
+/**
+ * Aligns the size by the machine word.
+ */
+inline size_t align(size_t n)
+{
+    return (n + sizeof(word_t) - 1) & ~(sizeof(word_t) - 1);
+}
+
+/**
+ * Minimum payload size: a free block stores two free-list links in it.
+ */
+static constexpr size_t kMinPayloadSize = 2 * sizeof(word_t);
+
+/**
+ * Object header size, without the first data word.
+ */
+static constexpr size_t kHeaderSize = sizeof(Block) - sizeof(std::declval<Block>().data);
+
+/**
+ * Returns total allocation size, reserving in addition the space for
+ * the Block structure (object header + first data word).
+ *
+ * Since the `word_t data[1]` already allocates one word inside the Block
+ * structure, we decrease it from the size request: if a user allocates
+ * only one word, it's fully in the Block struct.
+ */
+inline size_t allocSize(size_t size) {
+  return size + kHeaderSize;
+}
+
+/**
+ * Returns the object header.
+ */
+Block* getHeader(word_t* data) {
+  return (Block*)((char*)data - kHeaderSize);
+}
+
+// ---------------------------------------------------------
+// Values
+
+/**
+ * The collector needs to tell references from other data in the
+ * payloads. As in many dynamic language runtimes, every payload word
+ * is a value: a word with the low bit set is an immediate (a tagged
+ * integer), zero is null, and anything else is a pointer to the
+ * payload of another block.
+ */
+inline bool isPointer(word_t value) {
+  return value != 0 && (value & 1) == 0;
+}
+
+inline word_t tagInt(intptr_t n) {
+  return (word_t)(((uintptr_t)n << 1) | 1);
+}
+
+inline intptr_t untagInt(word_t value) {
+  return value >> 1;
+}
+
+// ---------------------------------------------------------
+// Free lists
+
+/**
+ * Free blocks don't use their payload, so the free-list links
+ * are stored in the first two data words instead of growing the header.
+ * Like in chapter 03, they're accessed with memcpy.
+ */
+inline Block* nextFree(Block* block) {
+  Block* next;
+  memcpy(&next, &block->data[0], sizeof(next));
+  return next;
+}
+
+inline Block* prevFree(Block* block) {
+  Block* prev;
+  memcpy(&prev, (char*)block->data + sizeof(Block*), sizeof(prev));
+  return prev;
+}
+
+inline void setNextFree(Block* block, Block* next) {
+  memcpy(&block->data[0], &next, sizeof(next));
+}
+
+inline void setPrevFree(Block* block, Block* prev) {
+  memcpy((char*)block->data + sizeof(Block*), &prev, sizeof(prev));
+}
+
+/**
+ * Number of exact size classes: 8, 16, 24, ..., 128 bytes.
+ */
+static constexpr size_t kExactClasses = 16;
+
+/**
+ * Largest size served by an exact class.
+ */
+static constexpr size_t kMaxExactSize = kExactClasses * sizeof(word_t);
+
+/**
+ * Number of power-of-two classes above the exact ones:
+ * (128, 256], (256, 512], ... The last one also takes everything bigger.
+ */
+static constexpr size_t kPowerOfTwoClasses = 24;
+
+/**
+ * Total number of size classes.
+ */
+static constexpr size_t kSizeClasses = kExactClasses + kPowerOfTwoClasses;
+
+/**
+ * Free lists per size class, and the mask of the non-empty ones.
+ */
+static Block* freeLists[kSizeClasses];
+static uint64_t nonEmptyClasses = 0;
+
+/**
+ * Returns the size class of an aligned size.
+ */
+inline size_t sizeClass(size_t alignedSize) {
+  if (alignedSize <= kMaxExactSize) {
+    return alignedSize / sizeof(word_t) - 1;
+  }
+
+  size_t bits = 64 - __builtin_clzll(alignedSize - 1);
+  size_t index = kExactClasses + bits - 8;
+
+  return index < kSizeClasses ? index : kSizeClasses - 1;
+}
+
+/**
+ * Pushes a free block to the list of its size class.
+ */
+void insertFree(Block* block) {
+  size_t index = sizeClass(getSize(block));
+  Block*& head = freeLists[index];
+
+  setPrevFree(block, nullptr);
+  setNextFree(block, head);
+  if (head != nullptr) {
+    setPrevFree(head, block);
+  }
+  head = block;
+
+  nonEmptyClasses |= uint64_t(1) << index;
+}
+
+/**
+ * Unlinks a block from its free list in O(1).
+ */
+void removeFree(Block* block) {
+  size_t index = sizeClass(getSize(block));
+  Block*& head = freeLists[index];
+
+  if (prevFree(block) != nullptr) {
+    setNextFree(prevFree(block), nextFree(block));
+  } else {
+    head = nextFree(block);
+  }
+
+  if (nextFree(block) != nullptr) {
+    setPrevFree(nextFree(block), prevFree(block));
+  }
+
+  if (head == nullptr) {
+    nonEmptyClasses &= ~(uint64_t(1) << index);
+  }
+}
+
+/**
+ * Segregated-fit algorithm (see chapter 03).
+ */
+Block* findBlock(size_t size) {
+  size_t index = sizeClass(size);
+
+  if (index >= kExactClasses) {
+    for (Block* block = freeLists[index]; block != nullptr; block = nextFree(block)) {
+      if (getSize(block) >= size) {
+        return block;
+      }
+    }
+
+    index++;
+  }
+
+  uint64_t candidates = index < 64 ? nonEmptyClasses & (~uint64_t(0) << index) : 0;
+  if (candidates == 0) {
+    return nullptr;
+  }
+
+  return freeLists[__builtin_ctzll(candidates)];
+}
+
+// ---------------------------------------------------------
+// Chunks
+
+/**
+ * Chunks are mapped at `kChunkSize`-aligned addresses, so the chunk
+ * of a block is found by masking the block address.
+ */
+static constexpr size_t kChunkSize = size_t(256) << 10;
+
+/**
+ * Objects bigger than this get a chunk of their own.
+ */
+static constexpr size_t kLargeObjectThreshold = kChunkSize / 4;
+
+/**
+ * Region of memory mapped from the OS, blocks are bump-allocated in it.
+ */
+struct Chunk
+{
+    /**
+     * Previously mapped chunk.
+     */
+    Chunk* next;
+
+    /**
+     * Mapped size, including this header.
+     */
+    size_t size;
+
+    /**
+     * First unused byte, and the end of the chunk.
+     */
+    char* bump;
+    char* end;
+
+    /**
+     * A large chunk holds a single block, and its mark is kept
+     * here instead of in the bitmaps.
+     */
+    bool large;
+    bool largeMarked;
+
+    /**
+     * Card table: one byte per `kCardSize` bytes of the chunk, and the
+     * bytes it takes in a large chunk (word-aligned).
+     */
+    uint8_t* cards;
+    size_t cardCount;
+    size_t cardTableSize;
+};
+
+/**
+ * The write barrier records stores at this granularity.
+ */
+static constexpr size_t kCardSize = 512;
+static constexpr size_t kCardsPerChunk = kChunkSize / kCardSize;
+
+/**
+ * Bitmap words per chunk: one bit per word granule.
+ */
+static constexpr size_t kBitmapWords = kChunkSize / sizeof(word_t) / 64;
+
+/**
+ * Side tables of a small chunk, right after its header: one bit per
+ * granule for the block starts, and one for the marks. Marking only
+ * writes here, so it doesn't dirty the cache lines of live objects
+ * (nor their copy-on-write pages after a fork), and the sweep scans
+ * 64 granules per bitmap word.
+ */
+struct ChunkBitmaps
+{
+    uint64_t starts[kBitmapWords];
+    uint64_t marks[kBitmapWords];
+    uint8_t cards[kCardsPerChunk];
+};
+
+inline ChunkBitmaps* bitmaps(Chunk* chunk) {
+  return (ChunkBitmaps*)(chunk + 1);
+}
+
+/**
+ * A large chunk has no bitmaps, only its card table.
+ */
+inline char* blocksStart(Chunk* chunk) {
+  return chunk->large ? (char*)(chunk + 1) + chunk->cardTableSize : (char*)(bitmaps(chunk) + 1);
+}
+
+inline Chunk* chunkOf(void* address) {
+  return (Chunk*)((uintptr_t)address & ~(kChunkSize - 1));
+}
+
+/**
+ * Index of the granule of an address in its chunk, and back.
+ */
+inline size_t granule(Chunk* chunk, void* address) {
+  return ((char*)address - (char*)chunk) / sizeof(word_t);
+}
+
+inline char* granuleAddress(Chunk* chunk, size_t index) {
+  return (char*)chunk + index * sizeof(word_t);
+}
+
+inline bool testBit(uint64_t* bits, size_t index) {
+  return bits[index / 64] & (uint64_t(1) << (index % 64));
+}
+
+inline void setBit(uint64_t* bits, size_t index) {
+  bits[index / 64] |= uint64_t(1) << (index % 64);
+}
+
+/**
+ * Clears the bits [from, to), a word at a time.
+ */
+void clearBits(uint64_t* bits, size_t from, size_t to) {
+  while (from < to) {
+    size_t bit = from % 64;
+    size_t count = std::min<size_t>(64 - bit, to - from);
+    uint64_t mask = count == 64 ? ~uint64_t(0) : ((uint64_t(1) << count) - 1) << bit;
+
+    bits[from / 64] &= ~mask;
+    from += count;
+  }
+}
+
+inline void setBlockStart(Block* block) {
+  Chunk* chunk = chunkOf(block);
+  setBit(bitmaps(chunk)->starts, granule(chunk, block));
+}
+
+inline bool isMarked(Block* block) {
+  Chunk* chunk = chunkOf(block);
+  if (chunk->large) {
+    return chunk->largeMarked;
+  }
+  return testBit(bitmaps(chunk)->marks, granule(chunk, block));
+}
+
+inline void setMarked(Block* block) {
+  Chunk* chunk = chunkOf(block);
+  if (chunk->large) {
+    chunk->largeMarked = true;
+    return;
+  }
+  setBit(bitmaps(chunk)->marks, granule(chunk, block));
+}
+
+/**
+ * All mapped chunks, and the small one blocks are bump-allocated from.
+ */
+static Chunk* chunks = nullptr;
+static Chunk* current = nullptr;
+
+/**
+ * Splits the block if the rest is big enough for a free block.
+ */
+void split(Block* block, size_t size) {
+  if (getSize(block) < allocSize(size) + kMinPayloadSize) {
+    return;
+  }
+
+  Block* freePart = (Block*)((char*)block + allocSize(size));
+  freePart->sizeAndFlags = getSize(block) - allocSize(size);
+  setBlockStart(freePart);
+  insertFree(freePart);
+
+  setSize(block, size);
+}
+
+/**
+ * Maps a chunk of `chunkSize` bytes at a `kChunkSize`-aligned address.
+ * Fresh anonymous memory is zeroed, so are the bitmaps.
+ */
+Chunk* mapChunk(size_t chunkSize) {
+  // Over-maps, and cuts the aligned part out of the mapping.
+  size_t mappedSize = chunkSize + kChunkSize;
+  void* memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  char* start = (char*)memory;
+  char* aligned = (char*)(((uintptr_t)start + kChunkSize - 1) & ~(kChunkSize - 1));
+  if (aligned > start) {
+    munmap(start, aligned - start);
+  }
+  munmap(aligned + chunkSize, start + mappedSize - (aligned + chunkSize));
+
+  Chunk* chunk = (Chunk*)aligned;
+  chunk->next = chunks;
+  chunk->size = chunkSize;
+  chunk->end = aligned + chunkSize;
+
+  chunks = chunk;
+  return chunk;
+}
+
+/**
+ * Makes [from, to) of a chunk one free block.
+ */
+void freeRange(Chunk* chunk, char* from, char* to) {
+  clearBits(bitmaps(chunk)->starts, granule(chunk, from), granule(chunk, to));
+
+  Block* block = (Block*)from;
+  block->sizeAndFlags = to - from - kHeaderSize;
+  setBlockStart(block);
+  insertFree(block);
+}
+
+/**
+ * Turns the unused end of the current chunk into a free block,
+ * so it's not lost when the next chunk is mapped.
+ */
+void retireChunkTail() {
+  if ((size_t)(current->end - current->bump) >= allocSize(kMinPayloadSize)) {
+    freeRange(current, current->bump, current->end);
+  }
+  current->bump = current->end;
+}
+
+/**
+ * Allocates an old block in a chunk of its own.
+ */
+Block* allocLarge(size_t size) {
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  // The card table covers the whole chunk, itself included: grows
+  // it until it covers the (page-rounded) chunk it's part of.
+  size_t cardTableSize = 0;
+  size_t chunkSize;
+  for (;;) {
+    chunkSize = sizeof(Chunk) + cardTableSize + allocSize(size);
+    chunkSize = (chunkSize + pageSize - 1) & ~(pageSize - 1);
+
+    size_t needed = align((chunkSize + kCardSize - 1) / kCardSize);
+    if (needed <= cardTableSize) {
+      break;
+    }
+    cardTableSize = needed;
+  }
+
+  Chunk* chunk = mapChunk(chunkSize);
+  if (chunk == nullptr) {
+    return nullptr;
+  }
+
+  chunk->large = true;
+  chunk->bump = chunk->end;
+  chunk->cards = (uint8_t*)(chunk + 1);
+  chunk->cardCount = (chunkSize + kCardSize - 1) / kCardSize;
+  chunk->cardTableSize = cardTableSize;
+
+  Block* block = (Block*)blocksStart(chunk);
+  block->sizeAndFlags = size;
+
+  return block;
+}
+
+/**
+ * Bump-allocates a new block from the current chunk,
+ * mapping a new one when needed.
+ */
+Block* requestFromOS(size_t size) {
+  size_t needed = allocSize(size);
+
+  // OOM. (Out Of Memory)
+  if (current == nullptr || current->bump + needed > current->end) {
+    Chunk* chunk = mapChunk(kChunkSize);
+    if (chunk == nullptr) {
+      return nullptr;
+    }
+
+    if (current != nullptr) {
+      retireChunkTail();
+    }
+
+    chunk->bump = blocksStart(chunk);
+    chunk->cards = bitmaps(chunk)->cards;
+    chunk->cardCount = kCardsPerChunk;
+    current = chunk;
+  }
+
+  Block* block = (Block*)current->bump;
+  current->bump += needed;
+
+  block->sizeAndFlags = size;
+  setBlockStart(block);
+
+  return block;
+}
+
+// ---------------------------------------------------------
+// Nursery
+
+/**
+ * The young generation: a single region, bump-allocated, and emptied
+ * as a whole by every minor collection.
+ */
+static char* nurseryStart = nullptr;
+static char* nurseryEnd = nullptr;
+static char* nurseryBump = nullptr;
+
+static size_t nurserySize = size_t(256) << 10;
+
+inline bool inNursery(void* address) {
+  return (char*)address >= nurseryStart && (char*)address < nurseryEnd;
+}
+
+/**
+ * Maps the nursery of `size` bytes.
+ */
+bool initNursery(size_t size) {
+  if (nurseryStart != nullptr) {
+    munmap(nurseryStart, nurseryEnd - nurseryStart);
+  }
+
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    nurseryStart = nurseryEnd = nurseryBump = nullptr;
+    return false;
+  }
+
+  nurserySize = size;
+  nurseryStart = nurseryBump = (char*)memory;
+  nurseryEnd = nurseryStart + size;
+  return true;
+}
+
+// ---------------------------------------------------------
+// Collector
+
+/**
+ * Root set: addresses of the slots (globals, locals of the host
+ * program) that hold values referring to the heap. They're updated
+ * when young objects are promoted.
+ */
+static std::vector<word_t*> roots;
+
+void addRoot(word_t* slot) {
+  roots.push_back(slot);
+}
+
+void removeRoot(word_t* slot) {
+  auto root = std::find(roots.begin(), roots.end(), slot);
+  if (root != roots.end()) {
+    roots.erase(root);
+  }
+}
+
+/**
+ * Payload bytes of all used old blocks.
+ */
+static size_t usedBytes = 0;
+
+/**
+ * Bytes promoted (or allocated old) since the last major collection,
+ * and how many trigger the next one.
+ */
+static size_t promotedSinceMajor = 0;
+static size_t majorThreshold = size_t(1) << 20;
+
+/**
+ * Lower bound of the major threshold. After each major collection the
+ * threshold becomes the old live size, but not less.
+ */
+static size_t minMajorThreshold = size_t(1) << 20;
+
+void setMajorThreshold(size_t bytes) {
+  minMajorThreshold = bytes;
+  majorThreshold = bytes;
+}
+
+/**
+ * Collector statistics.
+ */
+struct GCStats
+{
+    size_t minorCollections;
+    size_t majorCollections;
+    size_t promotedBytes;
+    size_t scannedCards;
+    size_t liveBytes;
+    size_t freedBytes;
+};
+
+static GCStats gcStats;
+
+/**
+ * Card of an address in an old object. The chunk is found from the
+ * object header, which is always in the first `kChunkSize` bytes
+ * (a large object may span more).
+ */
+inline uint8_t& cardOf(word_t* object, void* address) {
+  Chunk* chunk = chunkOf(getHeader(object));
+  return chunk->cards[((char*)address - (char*)chunk) / kCardSize];
+}
+
+/**
+ * Write barrier: every store of a value into a heap object goes
+ * through it. A young reference stored into an old object dirties
+ * the card of the slot: the only old-to-young edges a minor
+ * collection has to know about are in the dirty cards.
+ */
+inline void writeRef(word_t* object, size_t index, word_t value) {
+  object[index] = value;
+
+  if (isPointer(value) && inNursery((void*)value) && !inNursery(object)) {
+    cardOf(object, &object[index]) = 1;
+  }
+}
+
+/**
+ * Allocates an old block (from the free lists, or the chunks).
+ */
+Block* oldAlloc(size_t size) {
+  Block* block;
+
+  if (allocSize(size) > kLargeObjectThreshold) {
+    block = allocLarge(size);
+  } else if ((block = findBlock(size)) != nullptr) {
+    removeFree(block);
+    split(block, size);
+  } else {
+    block = requestFromOS(size);
+  }
+
+  if (block != nullptr) {
+    setUsed(block, true);
+    usedBytes += getSize(block);
+    promotedSinceMajor += getSize(block);
+  }
+
+  return block;
+}
+
+/**
+ * Promoted objects whose payload isn't scanned yet. They're scattered
+ * over the free lists, so unlike Cheney's to-space they need a stack.
+ */
+static std::vector<Block*> promotedStack;
+
+/**
+ * Copies the young object a value refers to into the old space (once),
+ * and returns the value updated to the new address. Old objects and
+ * immediates are returned as is.
+ */
+word_t promote(word_t value) {
+  if (!isPointer(value) || !inNursery((void*)value)) {
+    return value;
+  }
+
+  Block* block = getHeader((word_t*)value);
+  if (block->sizeAndFlags & kForwarded) {
+    return (word_t)(block->sizeAndFlags & ~kForwarded);
+  }
+
+  size_t size = getSize(block);
+  Block* copy = oldAlloc(size);
+  assert(copy != nullptr && "Out of memory during a minor collection");
+  memcpy(copy->data, block->data, size);
+
+  block->sizeAndFlags = (size_t)copy->data | kForwarded;
+  promotedStack.push_back(copy);
+  gcStats.promotedBytes += size;
+
+  return (word_t)copy->data;
+}
+
+/**
+ * Start of the block a granule of a small chunk belongs to: the
+ * closest block start at or before it, found a bitmap word at a time.
+ */
+size_t blockStartBefore(Chunk* chunk, size_t index) {
+  uint64_t* starts = bitmaps(chunk)->starts;
+  size_t word = index / 64;
+  uint64_t bits = starts[word] & (~uint64_t(0) >> (63 - index % 64));
+
+  while (bits == 0) {
+    bits = starts[--word];
+  }
+
+  return word * 64 + 63 - __builtin_clzll(bits);
+}
+
+/**
+ * Promotes the young objects referred to from the payload words of
+ * the used blocks which overlap [from, to). Free blocks are skipped:
+ * their links look like pointers.
+ */
+void scanRange(Chunk* chunk, char* from, char* to) {
+  char* cursor = chunk->large ? blocksStart(chunk)
+                              : granuleAddress(chunk, blockStartBefore(chunk, granule(chunk, from)));
+
+  while (cursor < to) {
+    Block* block = (Block*)cursor;
+    cursor += allocSize(getSize(block));
+
+    if (!isUsed(block)) {
+      continue;
+    }
+
+    word_t* slot = std::max<word_t*>(block->data, (word_t*)from);
+    word_t* end = std::min<word_t*>((word_t*)cursor, (word_t*)to);
+    for (; slot < end; slot++) {
+      *slot = promote(*slot);
+    }
+  }
+}
+
+/**
+ * Scans the dirty cards of all chunks, and cleans them. Clean cards
+ * are skipped eight at a time.
+ */
+void scanDirtyCards() {
+  for (Chunk* chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+    for (size_t card = 0; card < chunk->cardCount; card++) {
+      uint64_t eight;
+      if (card % 8 == 0 && card + 8 <= chunk->cardCount &&
+          (memcpy(&eight, &chunk->cards[card], 8), eight == 0)) {
+        card += 7;
+        continue;
+      }
+
+      if (chunk->cards[card] == 0) {
+        continue;
+      }
+      chunk->cards[card] = 0;
+      gcStats.scannedCards++;
+
+      char* from = std::max((char*)chunk + card * kCardSize, blocksStart(chunk));
+      char* to = std::min((char*)chunk + (card + 1) * kCardSize, chunk->bump);
+      if (from < to) {
+        scanRange(chunk, from, to);
+      }
+    }
+  }
+}
+
+/**
+ * Minor collection: evacuates everything reachable from the roots and
+ * the dirty cards out of the nursery, then resets it. Old objects on
+ * clean cards are never looked at.
+ */
+void minorGC() {
+  for (word_t* slot : roots) {
+    *slot = promote(*slot);
+  }
+
+  scanDirtyCards();
+
+  while (!promotedStack.empty()) {
+    Block* block = promotedStack.back();
+    promotedStack.pop_back();
+
+    size_t words = getSize(block) / sizeof(word_t);
+    for (size_t i = 0; i < words; i++) {
+      block->data[i] = promote(block->data[i]);
+    }
+  }
+
+  // All survivors are old now, so no old object refers to the nursery.
+  nurseryBump = nurseryStart;
+  gcStats.minorCollections++;
+}
+
+/**
+ * Grey old objects during a major collection.
+ */
+static std::vector<Block*> markStack;
+
+/**
+ * Marks the block a value refers to, if not yet marked.
+ */
+inline void markValue(word_t value) {
+  if (!isPointer(value)) {
+    return;
+  }
+
+  Block* block = getHeader((word_t*)value);
+  if (!isMarked(block)) {
+    setMarked(block);
+    markStack.push_back(block);
+  }
+}
+
+/**
+ * Mark phase of a major collection. Runs right after a minor one,
+ * so the nursery is empty and everything reachable is old.
+ */
+void mark() {
+  for (word_t* slot : roots) {
+    markValue(*slot);
+  }
+
+  while (!markStack.empty()) {
+    Block* block = markStack.back();
+    markStack.pop_back();
+
+    size_t words = getSize(block) / sizeof(word_t);
+    for (size_t i = 0; i < words; i++) {
+      markValue(block->data[i]);
+    }
+  }
+}
+
+/**
+ * Sweeps a small chunk from its bitmaps. Dead blocks are the starts
+ * without a mark: bitmap words with none are skipped at once, so fully
+ * live (or free) regions cost one test per 64 granules, and live
+ * headers are never touched. Each dead block is merged with the free
+ * and dead blocks following it, up to the next marked one.
+ */
+void sweepChunk(Chunk* chunk) {
+  ChunkBitmaps* bits = bitmaps(chunk);
+  size_t limit = granule(chunk, chunk->bump);
+  size_t index = granule(chunk, blocksStart(chunk));
+
+  while (index < limit) {
+    size_t word = index / 64;
+    uint64_t dead = bits->starts[word] & ~bits->marks[word] & (~uint64_t(0) << (index % 64));
+    if (dead == 0) {
+      index = (word + 1) * 64;
+      continue;
+    }
+
+    size_t from = word * 64 + __builtin_ctzll(dead);
+    if (from >= limit) {
+      break;
+    }
+
+    size_t to = from;
+    do {
+      Block* block = (Block*)granuleAddress(chunk, to);
+      if (isUsed(block)) {
+        usedBytes -= getSize(block);
+        gcStats.freedBytes += getSize(block);
+      }
+      to += allocSize(getSize(block)) / sizeof(word_t);
+    } while (to < limit && !testBit(bits->marks, to));
+
+    // The free end of the current chunk goes back to the bump area.
+    if (to == limit && chunk == current) {
+      clearBits(bits->starts, from, limit);
+      chunk->bump = granuleAddress(chunk, from);
+      break;
+    }
+
+    freeRange(chunk, granuleAddress(chunk, from), granuleAddress(chunk, to));
+    index = to;
+  }
+
+  memset(bits->marks, 0, sizeof(bits->marks));
+}
+
+/**
+ * Sweep phase: rebuilds the free lists from the unmarked blocks of
+ * every chunk, and unmaps the dead large objects.
+ */
+void sweep() {
+  for (auto& list : freeLists) {
+    list = nullptr;
+  }
+  nonEmptyClasses = 0;
+
+  Chunk** link = &chunks;
+  while (*link != nullptr) {
+    Chunk* chunk = *link;
+
+    if (!chunk->large) {
+      sweepChunk(chunk);
+    } else if (chunk->largeMarked) {
+      chunk->largeMarked = false;
+    } else {
+      Block* block = (Block*)blocksStart(chunk);
+      usedBytes -= getSize(block);
+      gcStats.freedBytes += getSize(block);
+
+      *link = chunk->next;
+      munmap(chunk, chunk->size);
+      continue;
+    }
+
+    link = &chunk->next;
+  }
+
+  gcStats.liveBytes = usedBytes;
+}
+
+/**
+ * Major collection: empties the nursery, then mark-sweeps the old space.
+ */
+void majorGC() {
+  minorGC();
+
+  mark();
+  sweep();
+
+  gcStats.majorCollections++;
+  promotedSinceMajor = 0;
+  majorThreshold = gcStats.liveBytes > minMajorThreshold ? gcStats.liveBytes : minMajorThreshold;
+}
+
+/**
+ * Allocates a block of memory of (at least) `size` bytes, in the
+ * nursery, or directly in the old space if it's too big for it.
+ * The payload is zeroed: it's scanned for references, stale values
+ * must not look like pointers. May run a collection first.
+ *
+ * Stores of references into the returned object have to go through
+ * `writeRef` as soon as the object may be old, i.e. after any
+ * allocation.
+ */
+word_t* alloc(size_t size)
+{
+  size = align(size);
+  if (size < kMinPayloadSize)
+  {
+    size = kMinPayloadSize;
+  }
+
+  if (nurseryStart == nullptr && !initNursery(nurserySize))
+  {
+    return nullptr;
+  }
+
+  // ---------------------------------------------------------
+  // 1. Objects too big for the nursery are allocated old:
+
+  if (allocSize(size) > nurserySize / 4)
+  {
+    if (promotedSinceMajor >= majorThreshold)
+    {
+      majorGC();
+    }
+
+    Block* block = oldAlloc(size);
+    if (block == nullptr)
+    {
+      return nullptr;
+    }
+
+    memset(block->data, 0, size);
+    return block->data;
+  }
+
+  // ---------------------------------------------------------
+  // 2. Out of the nursery: collect it (and the old space,
+  // once enough was promoted).
+
+  if (nurseryBump + allocSize(size) > nurseryEnd)
+  {
+    if (promotedSinceMajor >= majorThreshold)
+    {
+      majorGC();
+    }
+    else
+    {
+      minorGC();
+    }
+  }
+
+  // ---------------------------------------------------------
+  // 3. Bump:
+
+  Block* block = (Block*)nurseryBump;
+  nurseryBump += allocSize(size);
+
+  block->sizeAndFlags = size;
+  memset(block->data, 0, size);
+
+  return block->data;
+}
+
+/**
+ * Whether a payload of a small chunk belongs to a used block,
+ * i.e. wasn't reclaimed (nor reused yet).
+ */
+bool isAllocated(word_t* data) {
+  Block* block = getHeader(data);
+  Chunk* chunk = chunkOf(block);
+
+  return (char*)block < chunk->bump && testBit(bitmaps(chunk)->starts, granule(chunk, block)) &&
+         isUsed(block);
+}
+
+/**
+ * Validates the old space: blocks of each chunk add up to its bump pointer
+ * with a start bit each (and none inside), no two adjacent blocks are
+ * free, no marks are left, and the free lists hold exactly the free
+ * blocks.
+ */
+bool checkHeap() {
+  size_t freeBlocks = 0;
+
+  // Cards are only dirty between minor collections.
+  for (Chunk* chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+    for (size_t card = 0; card < chunk->cardCount; card++) {
+      if (chunk->cards[card] != 0 && nurseryBump == nurseryStart) {
+        return false;
+      }
+    }
+  }
+
+  for (Chunk* chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+    if (chunk->large) {
+      if (chunk->largeMarked) {
+        return false;
+      }
+      continue;
+    }
+
+    ChunkBitmaps* bits = bitmaps(chunk);
+    for (uint64_t word : bits->marks) {
+      if (word != 0) {
+        return false;
+      }
+    }
+
+    size_t blocks = 0;
+    bool prevFree = false;
+    char* cursor = blocksStart(chunk);
+
+    while (cursor < chunk->bump) {
+      Block* block = (Block*)cursor;
+      if (!testBit(bits->starts, granule(chunk, block))) {
+        return false;
+      }
+      if (!isUsed(block)) {
+        if (prevFree) {
+          return false;
+        }
+        freeBlocks++;
+      }
+
+      prevFree = !isUsed(block);
+      blocks++;
+      cursor += allocSize(getSize(block));
+    }
+
+    size_t starts = 0;
+    for (uint64_t word : bits->starts) {
+      starts += __builtin_popcountll(word);
+    }
+
+    if (cursor != chunk->bump || starts != blocks) {
+      return false;
+    }
+  }
+
+  for (Block* list : freeLists) {
+    for (Block* block = list; block != nullptr; block = nextFree(block)) {
+      if (isUsed(block)) {
+        return false;
+      }
+      freeBlocks--;
+    }
+  }
+
+  return freeBlocks == 0;
+}
+
+#define USE_GENERATIONS
+
+int main()
+{
+#ifdef USE_GENERATIONS
+  {
+    initNursery(size_t(64) << 10);
+
+    // --------------------------------------
+    // Test case 1: Nursery
+    //
+    // New objects are bump-allocated in the nursery.
+    //
+    word_t* a = alloc(16);
+    word_t* b = alloc(16);
+    assert(inNursery(a) && (char*)b == (char*)a + allocSize(16));
+
+    // --------------------------------------
+    // Test case 2: Promotion
+    //
+    // A minor collection moves the reachable young objects
+    // to the old space, and resets the nursery.
+    //
+    a[0] = (word_t)b;
+    a[1] = tagInt(1);
+    word_t* garbage = alloc(32);
+    garbage[0] = (word_t)a;
+
+    addRoot((word_t*)&a);
+    minorGC();
+
+    assert(!inNursery(a) && isAllocated(a));
+    assert(!inNursery((void*)a[0]) && untagInt(a[1]) == 1);
+    assert(nurseryBump == nurseryStart);
+    assert(gcStats.promotedBytes == 2 * 16); // not the garbage
+
+    // --------------------------------------
+    // Test case 3: Card table
+    //
+    // A young object only referenced from an old one survives a
+    // minor collection: the write barrier dirtied the card of the slot.
+    //
+    word_t* young = alloc(16);
+    young[0] = tagInt(42);
+    writeRef(a, 1, (word_t)young);
+    assert(cardOf(a, &a[1]) == 1);
+
+    size_t scanned = gcStats.scannedCards;
+    minorGC();
+    assert(gcStats.scannedCards == scanned + 1);
+    assert(cardOf(a, &a[1]) == 0);
+    assert(!inNursery((void*)a[1]) && untagInt(((word_t*)a[1])[0]) == 42);
+
+    // Old-to-old and immediate stores don't dirty cards:
+    writeRef((word_t*)a[0], 0, (word_t)a);
+    writeRef((word_t*)a[0], 1, tagInt(5));
+    assert(cardOf(a, (word_t*)a[0]) == 0);
+
+    // Only the dirty card of a big old object is scanned:
+    word_t* big = nullptr;
+    addRoot((word_t*)&big);
+    big = alloc(kChunkSize);
+    assert(!inNursery(big) && chunkOf(getHeader(big))->large);
+
+    young = alloc(16);
+    size_t last = kChunkSize / sizeof(word_t) - 1;
+    writeRef(big, last, (word_t)young);
+    assert(cardOf(big, &big[last]) == 1);
+
+    scanned = gcStats.scannedCards;
+    minorGC();
+    assert(gcStats.scannedCards == scanned + 1);
+    assert(!inNursery((void*)big[last]));
+
+    // Multi-MiB objects: the card table covers the block up to its
+    // last word, which is within the mapping.
+    for (size_t bytes : {size_t(2101176), size_t(5) << 20}) {
+      big = alloc(bytes);
+      assert(chunkOf(getHeader(big))->large);
+      assert((char*)big + bytes <= chunkOf(getHeader(big))->end);
+
+      young = alloc(16);
+      last = bytes / sizeof(word_t) - 1;
+      writeRef(big, last, (word_t)young);
+      assert(cardOf(big, &big[last]) == 1);
+
+      minorGC();
+      assert(!inNursery((void*)big[last]));
+    }
+
+    removeRoot((word_t*)&big);
+    assert(checkHeap());
+
+    // --------------------------------------
+    // Test case 4: Minor and major collections
+    //
+    // Short-lived garbage dies in the nursery, long-lived list nodes
+    // are promoted, and the major collections reclaim the old ones
+    // which were dropped.
+    //
+    setMajorThreshold(256 * 1024);
+
+    word_t* list = nullptr;
+    addRoot((word_t*)&list);
+
+    for (intptr_t i = 0; i < 100000; i++) {
+      word_t* node = alloc(16);
+      node[0] = tagInt(i);
+      writeRef(node, 1, (word_t)list);
+      list = node;
+
+      alloc(64); // garbage
+
+      // Keeps the last 1000 nodes only.
+      if (i % 1000 == 999) {
+        word_t* last = list;
+        for (int j = 0; j < 999; j++) {
+          last = (word_t*)last[1];
+        }
+        writeRef(last, 1, 0);
+      }
+    }
+
+    assert(gcStats.minorCollections > 10);
+    assert(gcStats.majorCollections > 0);
+    assert(gcStats.majorCollections < gcStats.minorCollections);
+
+    size_t mapped = 0;
+    for (Chunk* chunk = chunks; chunk != nullptr; chunk = chunk->next) {
+      mapped += chunk->size;
+    }
+    assert(mapped <= 4 * kChunkSize);
+
+    intptr_t expected = 99999;
+    for (word_t* node = list; node != nullptr; node = (word_t*)node[1]) {
+      assert(untagInt(node[0]) == expected--);
+    }
+    assert(expected == 98999);
+
+    removeRoot((word_t*)&list);
+    removeRoot((word_t*)&a);
+    majorGC();
+    assert(gcStats.liveBytes == 0);
+    assert(checkHeap());
+  }
+#endif
+
+  puts("\nAll assertions passed!\n");
+  return 0;
+}